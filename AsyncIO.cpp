@@ -0,0 +1,157 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#include "AsyncIO.h"
+
+#include "Patches/UnpageStreams.h"
+
+// Constructor
+CAsyncRead::CAsyncRead(const CTFileName &fnmFile) : ar_fnmFile(fnmFile), ar_pubData(NULL), ar_slSize(0),
+  ar_slReserved(0), ar_eState(E_PENDING)
+{
+  ar_ftWritten.dwLowDateTime = 0;
+  ar_ftWritten.dwHighDateTime = 0;
+  ar_hCompleted = CreateEventA(NULL, TRUE, FALSE, NULL);
+};
+
+// Destructor
+CAsyncRead::~CAsyncRead(void) {
+  free(Detach());
+  CloseHandle(ar_hCompleted);
+};
+
+// Take read contents away from the request
+UBYTE *CAsyncRead::Detach(void) {
+  UBYTE *pubData = ar_pubData;
+  ar_pubData = NULL;
+
+#if _PATCHCONFIG_ENGINEPATCHES && _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::BufferFreed(pubData);
+#endif
+
+  return pubData;
+};
+
+// Create a new backend of some type
+CAsyncIO *CAsyncIO::Create(EType eType, INDEX ctThreads) {
+  switch (eType) {
+    case E_THREADPOOL: return new CThreadPoolIO(ctThreads);
+  }
+
+  ASSERTALWAYS("Unknown asynchronous I/O backend!");
+  return NULL;
+};
+
+// Mark request as completed and notify waiting threads
+static void CompleteRead(CAsyncRead &read, CAsyncRead::EState eState) {
+  InterlockedExchange(&read.ar_eState, eState);
+  SetEvent(read.ar_hCompleted);
+};
+
+// Read the whole file on a worker thread
+static void ExecuteRead(void *pData) {
+  CAsyncRead &read = *(CAsyncRead *)pData;
+
+  HANDLE hFile = CreateFileA(read.ar_fnmFile.str_String, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+    NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+  if (hFile == INVALID_HANDLE_VALUE) {
+    CompleteRead(read, CAsyncRead::E_FAILED);
+    return;
+  }
+
+  // Streams can't hold files over 2 GB anyway
+  DWORD dwSizeHigh = 0;
+  const DWORD dwSize = GetFileSize(hFile, &dwSizeHigh);
+
+  if ((dwSize == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) || dwSizeHigh != 0 || dwSize > 0x7FFFFF00
+   || !GetFileTime(hFile, NULL, NULL, &read.ar_ftWritten)) {
+    CloseHandle(hFile);
+    CompleteRead(read, CAsyncRead::E_FAILED);
+    return;
+  }
+
+  DWORD dwRead = 0;
+
+  // Pad contents in the same way as stream buffers, so they can be handed over to streams
+  const DWORD dwAlloc = (dwSize / 64 + 2) * 64;
+
+  read.ar_pubData = (UBYTE *)malloc(dwAlloc);
+
+  if (read.ar_pubData == NULL) {
+    CloseHandle(hFile);
+    CompleteRead(read, CAsyncRead::E_FAILED);
+    return;
+  }
+
+  const BOOL bRead = ReadFile(hFile, read.ar_pubData, dwSize, &dwRead, NULL) && dwRead == dwSize;
+
+  CloseHandle(hFile);
+
+  if (!bRead) {
+    free(read.Detach());
+    CompleteRead(read, CAsyncRead::E_FAILED);
+    return;
+  }
+
+  memset(read.ar_pubData + dwSize, 0, dwAlloc - dwSize);
+
+  read.ar_slSize = dwSize;
+
+#if _PATCHCONFIG_ENGINEPATCHES && _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::BufferAllocated(read.ar_pubData, dwAlloc, IStreamStats::EBO_FILEREAD, read.ar_fnmFile);
+#endif
+
+  CompleteRead(read, CAsyncRead::E_DONE);
+};
+
+// Fail read that has been dropped before execution
+static void DiscardRead(void *pData) {
+  CompleteRead(*(CAsyncRead *)pData, CAsyncRead::E_FAILED);
+};
+
+// Constructor
+CThreadPoolIO::CThreadPoolIO(INDEX ctThreads) : tpio_ctThreads(ctThreads)
+{
+};
+
+// Destructor
+CThreadPoolIO::~CThreadPoolIO(void)
+{
+  Stop();
+};
+
+// Start executing a batch of reads
+void CThreadPoolIO::Submit(CAsyncRead **apReads, INDEX ct) {
+  if (!tpio_wpThreads.IsStarted()) {
+    tpio_wpThreads.Start(tpio_ctThreads, THREAD_PRIORITY_BELOW_NORMAL);
+  }
+
+  for (INDEX i = 0; i < ct; i++) {
+    tpio_wpThreads.AddJob(&ExecuteRead, apReads[i], &DiscardRead);
+  }
+};
+
+// Wait until a submitted request is completed
+void CThreadPoolIO::Wait(CAsyncRead &read) {
+  WaitForSingleObject(read.ar_hCompleted, INFINITE);
+};
+
+// Drop reads that haven't started and wait for the rest
+void CThreadPoolIO::Stop(void) {
+  tpio_wpThreads.Stop();
+};
@@ -0,0 +1,103 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef CECIL_INCL_ASYNCIO_H
+#define CECIL_INCL_ASYNCIO_H
+
+#ifdef PRAGMA_ONCE
+  #pragma once
+#endif
+
+#include "WorkerPool.h"
+
+// Request for reading a whole file into memory
+class CAsyncRead {
+  public:
+    // Request states
+    enum EState {
+      E_PENDING = 0,
+      E_DONE,
+      E_FAILED,
+    };
+
+  public:
+    CTFileName ar_fnmFile; // Full path to the file
+    UBYTE *ar_pubData; // Read contents followed by zeroed padding (owned by the request)
+    SLONG ar_slSize; // Size of the contents
+    FILETIME ar_ftWritten; // Last write time of the file when it was read
+    SLONG ar_slReserved; // Memory reserved for the contents by whoever submitted the request
+    LONG ar_eState; // Current state
+    HANDLE ar_hCompleted; // Set once the request is completed
+
+  public:
+    // Constructor
+    CAsyncRead(const CTFileName &fnmFile);
+
+    // Destructor
+    ~CAsyncRead(void);
+
+    // Take read contents away from the request
+    UBYTE *Detach(void);
+};
+
+// Backend that executes file reads in the background
+class CAsyncIO {
+  public:
+    // Types of available backends
+    enum EType {
+      E_THREADPOOL = 0, // Blocking reads on worker threads
+    };
+
+  public:
+    // Destructor
+    virtual ~CAsyncIO(void) {};
+
+    // Start executing a batch of reads (requests must stay alive until they are completed)
+    virtual void Submit(CAsyncRead **apReads, INDEX ct) = 0;
+
+    // Wait until a submitted request is completed
+    virtual void Wait(CAsyncRead &read) = 0;
+
+    // Drop reads that haven't started and wait for the rest
+    virtual void Stop(void) = 0;
+
+    // Create a new backend of some type
+    static CAsyncIO *Create(EType eType, INDEX ctThreads);
+};
+
+// Backend that executes blocking reads on a pool of threads
+class CThreadPoolIO : public CAsyncIO {
+  public:
+    CWorkerPool tpio_wpThreads; // Threads that execute reads
+    INDEX tpio_ctThreads; // How many threads to start
+
+  public:
+    // Constructor
+    CThreadPoolIO(INDEX ctThreads);
+
+    // Destructor
+    ~CThreadPoolIO(void);
+
+    // Start executing a batch of reads
+    virtual void Submit(CAsyncRead **apReads, INDEX ct);
+
+    // Wait until a submitted request is completed
+    virtual void Wait(CAsyncRead &read);
+
+    // Drop reads that haven't started and wait for the rest
+    virtual void Stop(void);
+};
+
+#endif
@@ -33,11 +33,22 @@ CPatches::CPatches() {
   _bNoListening = FALSE;
 
   _ulMaxWriteMemory = (1 << 20) * 128; // 128 MB
+  _iZipCacheSize = 16384; // 16 MB
+  _iZipWindowSize = 0;
+  _bCompressRemLevels = TRUE;
+  _iRemLevelsMemory = 0;
+  _iLargePageThreshold = 0;
+  _iDemoBlockSize = 256;
+  _bCompressDemos = FALSE;
+
+  _iPrefetchThreads = 2;
 
   _eWorldFormat = E_LF_CURRENT;
   _iWorldConverter = -1;
 };
 
+#include "Patches/UnpageStreams.h"
+
 // Apply core patches (called after Core initialization!)
 void CPatches::CorePatches(void) {
   // Hook this interface
@@ -81,6 +92,23 @@ void CPatches::CorePatches(void) {
   // Custom symbols for pre-engine initialization patches
 #if _PATCHCONFIG_FIX_STREAMPAGING
   _pShell->DeclareSymbol("user INDEX sam_bUsePlaceholderResources;", &_EnginePatches._bUsePlaceholderResources);
+  _pShell->DeclareSymbol("persistent user INDEX sam_iZipCacheSize;",  &_EnginePatches._iZipCacheSize);
+  _pShell->DeclareSymbol("persistent user INDEX sam_iZipWindowSize;", &_EnginePatches._iZipWindowSize);
+  _pShell->DeclareSymbol("persistent user INDEX sam_bCompressRememberedLevels;", &_EnginePatches._bCompressRemLevels);
+  _pShell->DeclareSymbol("persistent user INDEX sam_iRememberedLevelsMemory;",   &_EnginePatches._iRemLevelsMemory);
+  _pShell->DeclareSymbol("persistent user INDEX sam_iLargePageThreshold;",       &_EnginePatches._iLargePageThreshold);
+  _pShell->DeclareSymbol("persistent user INDEX sam_iDemoBlockSize;",            &_EnginePatches._iDemoBlockSize);
+  _pShell->DeclareSymbol("persistent user INDEX sam_bCompressDemos;",            &_EnginePatches._bCompressDemos);
+
+  _pShell->DeclareSymbol("user void sam_StreamStats(void);",          &IStreamStats::Print);
+  _pShell->DeclareSymbol("user void sam_ResetStreamStats(void);",     &IStreamStats::Reset);
+  _pShell->DeclareSymbol("user void sam_StreamBuffers(void);",        &IStreamStats::PrintBuffers);
+  _pShell->DeclareSymbol("user void sam_DumpStreamStats(CTString);", &IStreamStats::Dump);
+  _pShell->DeclareSymbol("user void sam_StreamBenchmark(INDEX);",     &IStreamStats::Benchmark);
+#endif
+
+#if _PATCHCONFIG_EXTEND_FILESYSTEM
+  _pShell->DeclareSymbol("persistent user INDEX sam_iPrefetchThreads;", &_EnginePatches._iPrefetchThreads);
 #endif
 };
 
@@ -320,6 +348,30 @@ void CPatches::Network(void) {
   pWriteSessionState = &CSessionState::Write_t;
   CreatePatch(pWriteSessionState, &CSessionStatePatch::P_Write, "CSessionState::Write_t(...)");
 
+  // Custom symbols
+  _pShell->DeclareSymbol("persistent user INDEX ser_bBatchedReceive;", &IPacketQueue::_bEnabled);
+  _pShell->DeclareSymbol("persistent user INDEX sam_bAsyncSaves;", &IAsyncSave::_bEnabled);
+  _pShell->DeclareSymbol("persistent user FLOAT sam_fDemoKeyframeInterval;", &IDemoSeek::_fKeyframeInterval);
+  _pShell->DeclareSymbol("user void sam_SeekDemo(FLOAT);", &IDemoSeek::Seek);
+  _pShell->DeclareSymbol("user void sam_TimeDemo(CTString, CTString);", &ITimeDemo::Run);
+
+  _pShell->DeclareSymbol("persistent user INDEX ser_bShareSessionState;", &IStateCache::_bEnabled);
+  _pShell->DeclareSymbol("user void ser_LoadTest(INDEX, INDEX);", &ILoadTest::Run);
+
+  _pShell->DeclareSymbol("persistent user INDEX sam_bTrafficStats;", &ITrafficStats::_bEnabled);
+  _pShell->DeclareSymbol("persistent user FLOAT sam_fTrafficRollup;", &ITrafficStats::_fRollupInterval);
+  _pShell->DeclareSymbol("user void sam_TrafficStats(void);",          &ITrafficStats::Print);
+  _pShell->DeclareSymbol("user void sam_ResetTrafficStats(void);",     &ITrafficStats::Reset);
+  _pShell->DeclareSymbol("user void sam_DumpTrafficStats(CTString);", &ITrafficStats::Dump);
+
+#if _PATCHCONFIG_NEW_QUERY
+  _pShell->DeclareSymbol("persistent user INDEX ser_bMasterThread;", &IMasterHeartbeat::_bThreaded);
+  _pShell->DeclareSymbol("persistent user FLOAT ser_fMasterInterval;", &IMasterHeartbeat::_fInterval);
+  _pShell->DeclareSymbol("user void ser_StartLocalMaster(INDEX);", &IMasterHeartbeat::StartLocalMaster);
+  _pShell->DeclareSymbol("user void ser_LocalMasterStatus(void);", &IMasterHeartbeat::PrintLocalMaster);
+  _pShell->DeclareSymbol("user void ser_StopLocalMaster(void);",   &IMasterHeartbeat::StopLocalMaster);
+#endif
+
 #if _PATCHCONFIG_GUID_MASKING
 
   void (CSessionState::*pMakeSyncCheck)(void) = &CSessionState::MakeSynchronisationCheck;
@@ -337,6 +389,8 @@ void CPatches::Network(void) {
 
   // Custom symbols
   _pShell->DeclareSymbol("persistent user INDEX ser_bMaskGUIDs pre:UpdateServerSymbolValue;", &IProcessPacket::_bMaskGUIDs);
+  _pShell->DeclareSymbol("persistent user INDEX ser_bCombineSyncChecks;", &ISyncCheck::_bCombine);
+  _pShell->DeclareSymbol("persistent user INDEX ser_iSyncCheckThreads;", &ISyncCheck::_iThreads);
 
 #endif // _PATCHCONFIG_GUID_MASKING
 
@@ -466,8 +520,6 @@ void CPatches::Worlds(void) {
   _pShell->DeclareSymbol("user INDEX sam_iWorldConverter;", &_EnginePatches._iWorldConverter);
 };
 
-#include "Patches/UnpageStreams.h"
-
 // Specific stream patching
 static void PatchStreams(void) {
 #if _PATCHCONFIG_FIX_STREAMPAGING
@@ -495,6 +547,9 @@ static void PatchStreams(void) {
   void (CTFileStream::*pCloseFunc)(void) = &CTFileStream::Close;
   CreatePatch(pCloseFunc, &CFileStreamPatch::P_Close, "CTFileStream::Close()");
 
+  // Stream buffers can be accessed directly and written in blocks now
+  _bUnpagedStreams = TRUE;
+
 #endif // _PATCHCONFIG_FIX_STREAMPAGING
 };
 
@@ -608,6 +663,26 @@ void CPatches::Cleanup(void) {
 #if _PATCHCONFIG_EXTEND_INPUT
   CInputPatch::Destruct();
 #endif
+
+#if _PATCHCONFIG_EXTEND_FILESYSTEM
+  IPrefetch::Stop();
+#endif
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  CRemLevel::StopSpilling();
+  IFileReads::Stop();
+  IZipCache::Clear();
+  IZipWindow::Stop();
+#endif
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+  IAsyncSave::Stop();
+
+  #if _PATCHCONFIG_NEW_QUERY
+    IMasterHeartbeat::Stop();
+    IMasterHeartbeat::StopLocalMaster();
+  #endif
+#endif
 };
 
 #endif // _PATCHCONFIG_ENGINEPATCHES
@@ -43,6 +43,16 @@ class PATCHES_API CPatches : public ICorePatches {
     // Unpage streams
     ULONG _ulMaxWriteMemory; // Enough memory for writing
     INDEX _bUsePlaceholderResources; // Automatically replace missing resources with placeholders
+    INDEX _iZipCacheSize; // Memory for keeping decompressed ZIP entries around (in KB)
+    INDEX _iZipWindowSize; // Decompress big ZIP entries in windows of this size as they're read (in KB, 0 = all at once)
+    INDEX _bCompressRemLevels; // Keep remembered levels compressed in memory
+    INDEX _iRemLevelsMemory; // Memory for remembered levels before the oldest ones are moved on disk (in KB, 0 = unlimited)
+    INDEX _iLargePageThreshold; // Try allocating stream buffers of this size and above with large pages (in KB, 0 = disabled)
+    INDEX _iDemoBlockSize; // Write recorded demos to disk in blocks of this size (in KB, 0 = only when stopped, at least 4 KB when compressed)
+    INDEX _bCompressDemos; // Compress recorded demo blocks (can only be played with these patches)
+
+    // File system
+    INDEX _iPrefetchThreads; // Threads for warming up resources from stream dictionaries (0 = disabled)
 
     // Worlds
     ELevelFormat _eWorldFormat; // Format of the last loaded world
@@ -0,0 +1,278 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+#include "UnpageStreams.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Take full session state snapshots this often while recording demos (in seconds, 0 = disabled)
+FLOAT IDemoSeek::_fKeyframeInterval = 0.0f;
+
+// Seek index identifiers
+static const char *_strIndexHeader = "DSKI";
+static const char *_strKeyframe = "DKEY";
+
+// Version of seek indices
+static const ULONG _ulIndexVersion = 1;
+
+// Session state snapshot in the seek index
+struct DemoKeyframe {
+  FLOAT fDemoTime; // Last processed tick at the moment of the snapshot (same time base as demo sequences)
+  SLONG slDemoOffset; // Position in the demo stream that follows the snapshot
+  SLONG slDataOffset; // Where the snapshot is in the index file
+  SLONG slSize; // Snapshot size
+};
+
+// Index that's being recorded
+static FILE *_pfRecording = NULL;
+static FLOAT _fNextKeyframe = 0.0f;
+
+// Index of the demo that's being played
+static CTFileName _fnmPlayIndex;
+static CStaticStackArray<DemoKeyframe> _aKeyframes;
+
+// Get seek index file of a demo
+static CTFileName IndexFile(const CTFileName &fnDemo) {
+  return fnDemo.NoExt() + ".dsi";
+};
+
+// Get position of the demo that's being recorded
+static SLONG RecordedPosition(void) {
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  return IDemoBlocks::Position(_pNetwork->ga_strmDemoRec);
+#else
+  return _pNetwork->ga_strmDemoRec.GetPos_t();
+#endif
+};
+
+// Start recording seek index for a demo
+void IDemoSeek::StartRecording(const CTFileName &fnDemo) {
+  StopRecording();
+
+  CTFileName fnmFull;
+  ExpandFilePath(EFP_WRITE, IndexFile(fnDemo), fnmFull);
+
+  // Remove index of a previous demo with the same name, so it's not loaded with this one
+  if (_fKeyframeInterval <= 0.0f) {
+    remove(fnmFull.str_String);
+    return;
+  }
+
+  _pfRecording = fopen(fnmFull.str_String, "wb");
+
+  if (_pfRecording == NULL) {
+    CPrintF(TRANS("Cannot create demo seek index '%s'!\n"), fnmFull.str_String);
+    return;
+  }
+
+  fwrite(_strIndexHeader, 4, 1, _pfRecording);
+  fwrite(&_ulIndexVersion, sizeof(_ulIndexVersion), 1, _pfRecording);
+
+  // Initial session state is in the demo itself
+  _fNextKeyframe = FLOAT(_pNetwork->ga_sesSessionState.ses_tmLastProcessedTick) + ClampDn(_fKeyframeInterval, 1.0f);
+};
+
+// Take a snapshot of the session state, if it's time
+void IDemoSeek::Record(void) {
+  if (_pfRecording == NULL) return;
+
+  // Demo timer isn't advanced while recording, so use the time that's written into the demo with each tick
+  const FLOAT fDemoTime = FLOAT(_pNetwork->ga_sesSessionState.ses_tmLastProcessedTick);
+  if (fDemoTime < _fNextKeyframe) return;
+
+  _fNextKeyframe = fDemoTime + ClampDn(_fKeyframeInterval, 1.0f);
+
+  try {
+    CTMemoryStream strmState;
+    _pNetwork->ga_sesSessionState.Write_t(&strmState);
+
+    UBYTE *pubState;
+    SLONG slSize;
+    strmState.LockBuffer(&pubState, &slSize);
+
+    const SLONG slDemoOffset = RecordedPosition();
+
+    fwrite(_strKeyframe, 4, 1, _pfRecording);
+    fwrite(&fDemoTime, sizeof(fDemoTime), 1, _pfRecording);
+    fwrite(&slDemoOffset, sizeof(slDemoOffset), 1, _pfRecording);
+    fwrite(&slSize, sizeof(slSize), 1, _pfRecording);
+    fwrite(pubState, slSize, 1, _pfRecording);
+
+    strmState.UnlockBuffer();
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Cannot write demo keyframe:\n%s\n"), strError);
+    StopRecording();
+  }
+};
+
+// Finish recording seek index
+void IDemoSeek::StopRecording(void) {
+  if (_pfRecording == NULL) return;
+
+  fclose(_pfRecording);
+  _pfRecording = NULL;
+};
+
+// Load seek index of a demo, if there is one
+void IDemoSeek::Load(const CTFileName &fnDemo) {
+  Clear();
+
+  CTFileName fnmFull;
+  if (ExpandFilePath(EFP_READ, IndexFile(fnDemo), fnmFull) != EFP_FILE) return;
+
+  FILE *pf = fopen(fnmFull.str_String, "rb");
+  if (pf == NULL) return;
+
+  // Snapshot sizes are checked against it
+  fseek(pf, 0, SEEK_END);
+  const SLONG slFileSize = ftell(pf);
+  fseek(pf, 0, SEEK_SET);
+
+  char strID[4];
+  ULONG ulVersion = 0;
+
+  if (fread(strID, 4, 1, pf) != 1 || memcmp(strID, _strIndexHeader, 4) != 0
+   || fread(&ulVersion, sizeof(ulVersion), 1, pf) != 1 || ulVersion != _ulIndexVersion) {
+    CPrintF(TRANS("Invalid demo seek index '%s'!\n"), fnmFull.str_String);
+    fclose(pf);
+    return;
+  }
+
+  // Go through keyframes until the end or until an incomplete one
+  while (fread(strID, 4, 1, pf) == 1 && memcmp(strID, _strKeyframe, 4) == 0) {
+    DemoKeyframe key;
+
+    if (fread(&key.fDemoTime, sizeof(key.fDemoTime), 1, pf) != 1
+     || fread(&key.slDemoOffset, sizeof(key.slDemoOffset), 1, pf) != 1
+     || fread(&key.slSize, sizeof(key.slSize), 1, pf) != 1) {
+      break;
+    }
+
+    key.slDataOffset = ftell(pf);
+
+    // Incomplete or broken snapshot
+    if (key.slSize <= 0 || key.slSize > slFileSize - key.slDataOffset) break;
+
+    // Skip snapshot data
+    if (fseek(pf, key.slSize, SEEK_CUR) != 0) break;
+
+    _aKeyframes.Push() = key;
+  }
+
+  fclose(pf);
+  _fnmPlayIndex = fnmFull;
+
+  CPrintF(TRANS("Loaded %d demo keyframes\n"), _aKeyframes.Count());
+};
+
+// Forget seek index of the played demo
+void IDemoSeek::Clear(void) {
+  _aKeyframes.PopAll();
+  _fnmPlayIndex = CTString("");
+};
+
+// Restore session state from a keyframe
+static void RestoreKeyframe(const DemoKeyframe &key) {
+  FILE *pf = fopen(_fnmPlayIndex.str_String, "rb");
+
+  if (pf == NULL) {
+    ThrowF_t(LOCALIZE("Cannot open demo seek index '%s'"), _fnmPlayIndex.str_String);
+  }
+
+  UBYTE *pubState = (UBYTE *)malloc(key.slSize);
+
+  if (pubState == NULL) {
+    fclose(pf);
+    ThrowF_t(LOCALIZE("Cannot allocate memory for demo keyframe from '%s'"), _fnmPlayIndex.str_String);
+  }
+
+  const BOOL bRead = (fseek(pf, key.slDataOffset, SEEK_SET) == 0 && fread(pubState, key.slSize, 1, pf) == 1);
+
+  fclose(pf);
+
+  if (!bRead) {
+    free(pubState);
+    ThrowF_t(LOCALIZE("Cannot read demo keyframe from '%s'"), _fnmPlayIndex.str_String);
+  }
+
+  CTMemoryStream strmState;
+  strmState.Write_t(pubState, key.slSize);
+  strmState.SetPos_t(0);
+  free(pubState);
+
+  CNetworkLibrary &nl = *_pNetwork;
+  nl.ga_sesSessionState.Read_t(&strmState);
+
+  // Continue reading the demo after the snapshot
+  nl.ga_strmDemoPlay.SetPos_t(key.slDemoOffset);
+  nl.ga_sesSessionState.ses_tmLastDemoSequence = key.fDemoTime;
+};
+
+// Jump to some time in the demo that's being played
+void IDemoSeek::Seek(void *pArgs) {
+  FLOAT fTarget = NEXTARGUMENT(FLOAT);
+  fTarget = ClampDn(fTarget, 0.0f);
+
+  CNetworkLibrary &nl = *_pNetwork;
+
+  if (!nl.ga_bDemoPlay) {
+    CPutString(TRANS("Not playing a demo!\n"));
+    return;
+  }
+
+  CTSingleLock slNetwork(&nl.ga_csNetwork, TRUE);
+
+  // Find the last keyframe before the target
+  INDEX iKey = -1;
+
+  for (INDEX i = 0; i < _aKeyframes.Count(); i++) {
+    if (_aKeyframes[i].fDemoTime > fTarget) break;
+    iKey = i;
+  }
+
+  const FLOAT fCurrent = nl.ga_sesSessionState.ses_tmLastDemoSequence;
+
+  // Keep playing from the current position if it's closer than the keyframe
+  if (fTarget >= fCurrent && (iKey == -1 || _aKeyframes[iKey].fDemoTime <= fCurrent)) {
+    nl.ga_fDemoTimer = fTarget;
+    return;
+  }
+
+  if (iKey == -1) {
+    CPrintF(TRANS("No demo keyframe before %.2fs!\n"), fTarget);
+    return;
+  }
+
+  try {
+    RestoreKeyframe(_aKeyframes[iKey]);
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Cannot seek demo:\n%s\n"), strError);
+    return;
+  }
+
+  // Replay the rest up to the target
+  nl.ga_fDemoTimer = fTarget;
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,504 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "UnpageStreams.h"
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+
+// Block demo identifiers
+static const char *_strBlockHeader = "DBLK";
+static const char *_strBlockIndex = "DIDX";
+
+// Version of block demos
+static const ULONG _ulBlockVersion = 1;
+
+// Smallest block of a compressed demo
+static const SLONG _slMinBlockSize = 4 * 1024;
+
+// Written block of a demo
+struct DemoBlock {
+  SLONG slFileOffset; // Where the block starts in the file
+  SLONG slDemoOffset; // Where its contents start in the plain demo
+};
+
+// Demo stream that's being recorded
+static CFileStreamPatch *_pstrmRec = NULL;
+static BOOL _bCompress = FALSE;
+static SLONG _slBlockSize = 0;
+
+// Blocks written so far
+static CStaticStackArray<DemoBlock> _aBlocks;
+static SLONG _slFileOffset = 0;
+static SLONG _slDemoOffset = 0;
+
+// Recorded file couldn't be written into
+static BOOL _bWriteFailed = FALSE;
+
+// Write data into the recorded file
+static void WriteRaw(const void *pData, SLONG slSize) {
+  if (_bWriteFailed || slSize <= 0) return;
+
+  if (fwrite(pData, slSize, 1, _pstrmRec->fstrm_pFile) != 1) {
+    CPrintF(TRANS("Cannot write demo '%s' (%s)\n"), _pstrmRec->strm_strStreamDescription.str_String, strerror(errno));
+    _bWriteFailed = TRUE;
+    return;
+  }
+
+  _slFileOffset += slSize;
+};
+
+// Write one block of demo contents
+static void WriteBlock(const UBYTE *pubData, SLONG slSize) {
+  DemoBlock &block = _aBlocks.Push();
+  block.slFileOffset = _slFileOffset;
+  block.slDemoOffset = _slDemoOffset;
+
+  CLZCompressor comp;
+  SLONG slPacked = comp.NeededDestinationSize(slSize);
+  UBYTE *pubPacked = (UBYTE *)malloc(slPacked);
+
+  // Store it as is if it can't be packed or it doesn't pay off
+  if (pubPacked == NULL || !comp.Pack(pubData, slSize, pubPacked, slPacked) || slPacked >= slSize) {
+    WriteRaw(&slSize, sizeof(slSize));
+    WriteRaw(&slSize, sizeof(slSize));
+    WriteRaw(pubData, slSize);
+
+  } else {
+    WriteRaw(&slSize, sizeof(slSize));
+    WriteRaw(&slPacked, sizeof(slPacked));
+    WriteRaw(pubPacked, slPacked);
+  }
+
+  free(pubPacked);
+  _slDemoOffset += slSize;
+};
+
+// Start writing a demo stream to disk in blocks as it's being recorded
+void IDemoBlocks::Start(CTFileStream &strm) {
+  ASSERT(_pstrmRec == NULL);
+
+  // Stream is paged by the engine
+  if (!_bUnpagedStreams) return;
+
+  _pstrmRec = (CFileStreamPatch *)&strm;
+  _bCompress = _EnginePatches._bCompressDemos;
+  _slBlockSize = ClampDn(_EnginePatches._iDemoBlockSize, (INDEX)0) * 1024;
+
+  // Compressed demos can't be written without blocks
+  if (_bCompress) {
+    _slBlockSize = ClampDn(_slBlockSize, _slMinBlockSize);
+  }
+
+  _aBlocks.PopAll();
+  _slFileOffset = 0;
+  _slDemoOffset = 0;
+  _bWriteFailed = FALSE;
+
+  if (_bCompress) {
+    WriteRaw(_strBlockHeader, 4);
+    WriteRaw(&_ulBlockVersion, sizeof(_ulBlockVersion));
+  }
+};
+
+// Write recorded data to disk, either in full blocks or completely
+static void FlushRecorded(BOOL bAll) {
+  CFileStreamPatch &strm = *_pstrmRec;
+
+  UBYTE *pubEnd = Max(strm.strm_pubCurrentPos, strm.strm_pubMaxPos);
+  ASSERT(strm.strm_pubCurrentPos == pubEnd);
+
+  const SLONG slWritten = pubEnd - strm.strm_pubBufferBegin;
+  SLONG slFlushed = 0;
+
+  // Write it as it is
+  if (!_bCompress) {
+    slFlushed = slWritten;
+    WriteRaw(strm.strm_pubBufferBegin, slFlushed);
+    _slDemoOffset += slFlushed;
+
+  } else {
+    // Write full blocks
+    while (slWritten - slFlushed >= _slBlockSize) {
+      WriteBlock(strm.strm_pubBufferBegin + slFlushed, _slBlockSize);
+      slFlushed += _slBlockSize;
+    }
+
+    // Write whatever's left
+    if (bAll && slWritten > slFlushed) {
+      WriteBlock(strm.strm_pubBufferBegin + slFlushed, slWritten - slFlushed);
+      slFlushed = slWritten;
+    }
+  }
+
+  // Move the rest to the beginning of the buffer
+  const SLONG slLeft = slWritten - slFlushed;
+  memmove(strm.strm_pubBufferBegin, strm.strm_pubBufferBegin + slFlushed, slLeft);
+
+  strm.strm_pubCurrentPos = strm.strm_pubBufferBegin + slLeft;
+  strm.strm_pubMaxPos = strm.strm_pubCurrentPos;
+};
+
+// Write full blocks of recorded data to disk (FALSE if the demo can't be written anymore)
+BOOL IDemoBlocks::Update(void) {
+  if (_pstrmRec == NULL || _slBlockSize <= 0) return TRUE;
+
+  const SLONG slWritten = _pstrmRec->strm_pubCurrentPos - _pstrmRec->strm_pubBufferBegin;
+
+  if (slWritten >= _slBlockSize) {
+    FlushRecorded(FALSE);
+  }
+
+  return !_bWriteFailed;
+};
+
+// Get position in the plain demo that's being recorded
+SLONG IDemoBlocks::Position(CTFileStream &strm) {
+  if (_pstrmRec != (CFileStreamPatch *)&strm) {
+    return strm.GetPos_t();
+  }
+
+  return _slDemoOffset + SLONG(_pstrmRec->strm_pubCurrentPos - _pstrmRec->strm_pubBufferBegin);
+};
+
+// Write the rest of the demo and the block index before closing the stream
+void IDemoBlocks::Finish(CTFileStream &strm) {
+  if (_pstrmRec != (CFileStreamPatch *)&strm) return;
+
+  // Nothing has been written to disk yet, so let the stream close normally
+  if (!_bCompress && _slFileOffset == 0 && !_bWriteFailed) {
+    _pstrmRec = NULL;
+    return;
+  }
+
+  // Drop the rest, since it can't be written after what's missing
+  if (_bWriteFailed) {
+    _pstrmRec->strm_pubCurrentPos = _pstrmRec->strm_pubBufferBegin;
+    _pstrmRec->strm_pubMaxPos = _pstrmRec->strm_pubBufferBegin;
+    _pstrmRec = NULL;
+    return;
+  }
+
+  FlushRecorded(TRUE);
+
+  // Index of all blocks for seeking
+  if (_bCompress) {
+    const SLONG slIndexOffset = _slFileOffset;
+    const INDEX ctBlocks = _aBlocks.Count();
+
+    WriteRaw(_strBlockIndex, 4);
+    WriteRaw(&ctBlocks, sizeof(ctBlocks));
+    WriteRaw(&_slDemoOffset, sizeof(_slDemoOffset));
+
+    if (ctBlocks > 0) {
+      WriteRaw(&_aBlocks[0], ctBlocks * sizeof(DemoBlock));
+    }
+
+    WriteRaw(&slIndexOffset, sizeof(slIndexOffset));
+  }
+
+  fflush(_pstrmRec->fstrm_pFile);
+  _pstrmRec = NULL;
+};
+
+// Size of plain demo parts that are decompressed at once during playback
+static const SLONG _slPlayWindow = 64 * 1024;
+
+// How many decompressed parts to keep before discarding the oldest ones
+static const INDEX _ctPlayWindows = 32;
+
+// Demo in blocks that's being played
+struct DemoPlayback {
+  UBYTE *pubBuffer; // Reserved plain demo
+  SLONG slReserved; // Reserved size with padding
+  SLONG slSize; // Plain demo size
+
+  UBYTE *pubFile; // Demo file with packed blocks
+  CStaticArray<DemoBlock> aBlocks; // Blocks in the file
+
+  UBYTE *pubScratch; // Last decompressed block
+  INDEX iScratchBlock;
+
+  CStaticStackArray<SLONG> aslWindows; // Accessible parts of the plain demo (oldest ones first)
+};
+
+static DemoPlayback *_pdpPlay = NULL;
+
+// Get plain size of some block
+static SLONG BlockSize(const DemoPlayback &dp, INDEX iBlock) {
+  const SLONG slEnd = (iBlock + 1 < dp.aBlocks.Count()) ? dp.aBlocks[iBlock + 1].slDemoOffset : dp.slSize;
+  return slEnd - dp.aBlocks[iBlock].slDemoOffset;
+};
+
+// Get plain contents of some block (NULL if it can't be decompressed)
+static const UBYTE *BlockContents(DemoPlayback &dp, INDEX iBlock) {
+  const UBYTE *pubHeader = dp.pubFile + dp.aBlocks[iBlock].slFileOffset;
+
+  SLONG slBlock, slBlockPacked;
+  memcpy(&slBlock, pubHeader, sizeof(slBlock));
+  memcpy(&slBlockPacked, pubHeader + 4, sizeof(slBlockPacked));
+
+  // Stored as is
+  if (slBlock == slBlockPacked) return pubHeader + 8;
+
+  if (dp.iScratchBlock != iBlock) {
+    CLZCompressor comp;
+    SLONG slUnpacked = slBlock;
+
+    if (!comp.Unpack(pubHeader + 8, slBlockPacked, dp.pubScratch, slUnpacked) || slUnpacked != slBlock) {
+      dp.iScratchBlock = -1;
+      return NULL;
+    }
+
+    dp.iScratchBlock = iBlock;
+    IStreamStats::Decompressed(slBlock);
+  }
+
+  return dp.pubScratch;
+};
+
+// Decompress part of the demo that's being accessed and discard the oldest part
+static BOOL HandlePlayAccess(void *pData, const UBYTE *pubAddress) {
+  DemoPlayback &dp = *(DemoPlayback *)pData;
+
+  const SLONG slWindow = ((pubAddress - dp.pubBuffer) / _slPlayWindow) * _slPlayWindow;
+  const SLONG slWindowSize = Min(_slPlayWindow, dp.slReserved - slWindow);
+
+  if (dp.aslWindows.Count() >= _ctPlayWindows) {
+    VirtualFree(dp.pubBuffer + dp.aslWindows[0], Min(_slPlayWindow, dp.slReserved - dp.aslWindows[0]), MEM_DECOMMIT);
+
+    for (INDEX i = 1; i < dp.aslWindows.Count(); i++) {
+      dp.aslWindows[i - 1] = dp.aslWindows[i];
+    }
+
+    dp.aslWindows.Pop();
+  }
+
+  // Committed pages are zeroed, which also covers the padding after the end
+  if (VirtualAlloc(dp.pubBuffer + slWindow, slWindowSize, MEM_COMMIT, PAGE_READWRITE) == NULL) return FALSE;
+
+  dp.aslWindows.Push() = slWindow;
+
+  // Find the last block that starts before this part
+  INDEX iBlock = 0;
+  INDEX iAfter = dp.aBlocks.Count();
+
+  while (iAfter - iBlock > 1) {
+    const INDEX iMiddle = (iBlock + iAfter) / 2;
+
+    if (dp.aBlocks[iMiddle].slDemoOffset <= slWindow) {
+      iBlock = iMiddle;
+    } else {
+      iAfter = iMiddle;
+    }
+  }
+
+  // Copy parts of all blocks that overlap it
+  const SLONG slWindowEnd = Min(slWindow + slWindowSize, dp.slSize);
+
+  for (; iBlock < dp.aBlocks.Count(); iBlock++) {
+    const SLONG slBlockStart = dp.aBlocks[iBlock].slDemoOffset;
+    if (slBlockStart >= slWindowEnd) break;
+
+    const SLONG slFrom = Max(slBlockStart, slWindow);
+    const SLONG slTo = Min(slBlockStart + BlockSize(dp, iBlock), slWindowEnd);
+    if (slFrom >= slTo) continue;
+
+    const UBYTE *pubBlock = BlockContents(dp, iBlock);
+    if (pubBlock == NULL) return FALSE;
+
+    memcpy(dp.pubBuffer + slFrom, pubBlock + (slFrom - slBlockStart), slTo - slFrom);
+  }
+
+  return TRUE;
+};
+
+// Find blocks using the index at the end of the file (FALSE if there's no valid index)
+static BOOL ReadBlockIndex(DemoPlayback &dp, SLONG slFileSize) {
+  const SLONG slHeader = 4 + sizeof(ULONG);
+
+  if (slFileSize < slHeader + 4 + 8 + 4) return FALSE;
+
+  SLONG slIndexOffset;
+  memcpy(&slIndexOffset, dp.pubFile + slFileSize - 4, sizeof(slIndexOffset));
+
+  if (slIndexOffset < slHeader || slIndexOffset > slFileSize - (4 + 8 + 4)) return FALSE;
+
+  const UBYTE *pubIndex = dp.pubFile + slIndexOffset;
+  if (memcmp(pubIndex, _strBlockIndex, 4) != 0) return FALSE;
+
+  INDEX ctBlocks;
+  SLONG slDemoSize;
+  memcpy(&ctBlocks, pubIndex + 4, sizeof(ctBlocks));
+  memcpy(&slDemoSize, pubIndex + 8, sizeof(slDemoSize));
+
+  // Index must end right before the offset to it
+  if (ctBlocks < 0 || slDemoSize < 0) return FALSE;
+  if (ctBlocks > (slFileSize - 4 - slIndexOffset - 12) / (SLONG)sizeof(DemoBlock)) return FALSE;
+  if (slIndexOffset + 12 + ctBlocks * (SLONG)sizeof(DemoBlock) != slFileSize - 4) return FALSE;
+
+  dp.aBlocks.New(ctBlocks);
+  dp.slSize = slDemoSize;
+
+  if (ctBlocks > 0) {
+    memcpy(&dp.aBlocks[0], pubIndex + 12, ctBlocks * sizeof(DemoBlock));
+  }
+
+  // Make sure that blocks are in order and stay within the file
+  SLONG slPrevOffset = 0;
+
+  for (INDEX i = 0; i < ctBlocks; i++) {
+    const DemoBlock &block = dp.aBlocks[i];
+
+    if (block.slDemoOffset != slPrevOffset) return FALSE;
+    if (block.slFileOffset < slHeader || block.slFileOffset > slIndexOffset - 8) return FALSE;
+
+    SLONG slBlock, slBlockPacked;
+    memcpy(&slBlock, dp.pubFile + block.slFileOffset, sizeof(slBlock));
+    memcpy(&slBlockPacked, dp.pubFile + block.slFileOffset + 4, sizeof(slBlockPacked));
+
+    if (slBlock <= 0 || slBlockPacked <= 0 || slBlockPacked > slIndexOffset - block.slFileOffset - 8) return FALSE;
+
+    slPrevOffset += slBlock;
+  }
+
+  return (slPrevOffset == slDemoSize);
+};
+
+// Find blocks by going through all of them (e.g. if recording has been interrupted before writing the index)
+static void ScanBlocks(DemoPlayback &dp, SLONG slFileSize) {
+  CStaticStackArray<DemoBlock> aFound;
+  SLONG slPos = 4 + sizeof(ULONG);
+  SLONG slDemoSize = 0;
+
+  while (slFileSize - slPos >= 8 && memcmp(dp.pubFile + slPos, _strBlockIndex, 4) != 0) {
+    SLONG slBlock, slBlockPacked;
+    memcpy(&slBlock, dp.pubFile + slPos, sizeof(slBlock));
+    memcpy(&slBlockPacked, dp.pubFile + slPos + 4, sizeof(slBlockPacked));
+
+    // Cut off at an incomplete block
+    if (slBlock <= 0 || slBlockPacked <= 0 || slBlockPacked > slFileSize - slPos - 8) break;
+
+    DemoBlock &block = aFound.Push();
+    block.slFileOffset = slPos;
+    block.slDemoOffset = slDemoSize;
+
+    slDemoSize += slBlock;
+    slPos += 8 + slBlockPacked;
+  }
+
+  dp.aBlocks.New(aFound.Count());
+  dp.slSize = slDemoSize;
+
+  for (INDEX i = 0; i < aFound.Count(); i++) {
+    dp.aBlocks[i] = aFound[i];
+  }
+};
+
+// Start decompressing demo in blocks that has just been read into the stream as it's being played
+void IDemoBlocks::Unpack(CFileStreamPatch &strm) {
+  const SLONG slFileSize = strm.strm_pubEOF - strm.strm_pubBufferBegin;
+  const SLONG slHeader = 4 + sizeof(ULONG);
+
+  // Not a block demo
+  if (slFileSize < slHeader || memcmp(strm.strm_pubBufferBegin, _strBlockHeader, 4) != 0) return;
+
+  const CTString strFile = strm.strm_strStreamDescription;
+
+  ULONG ulVersion;
+  memcpy(&ulVersion, strm.strm_pubBufferBegin + 4, sizeof(ulVersion));
+
+  if (ulVersion != _ulBlockVersion) {
+    ThrowF_t(LOCALIZE("Unsupported block demo version %u in '%s'"), ulVersion, strFile.str_String);
+  }
+
+  // Only one demo can be played at a time
+  ASSERT(_pdpPlay == NULL);
+
+  DemoPlayback *pdp = new DemoPlayback;
+  pdp->pubBuffer = NULL;
+  pdp->pubScratch = NULL;
+  pdp->iScratchBlock = -1;
+
+  // Keep the file while the stream is being reallocated
+  pdp->pubFile = (UBYTE *)malloc(slFileSize);
+
+  if (pdp->pubFile == NULL) {
+    delete pdp;
+    ThrowF_t(LOCALIZE("Cannot allocate memory for demo blocks in '%s'"), strFile.str_String);
+  }
+
+  memcpy(pdp->pubFile, strm.strm_pubBufferBegin, slFileSize);
+
+  if (!ReadBlockIndex(*pdp, slFileSize)) {
+    ScanBlocks(*pdp, slFileSize);
+  }
+
+  // Need space for decompressing the biggest block
+  SLONG slMaxBlock = 0;
+
+  for (INDEX iBlock = 0; iBlock < pdp->aBlocks.Count(); iBlock++) {
+    slMaxBlock = Max(slMaxBlock, BlockSize(*pdp, iBlock));
+  }
+
+  // Reserve the plain demo without making it accessible
+  pdp->slReserved = (pdp->slSize / 64 + 2) * 64;
+  pdp->pubBuffer = (UBYTE *)VirtualAlloc(NULL, pdp->slReserved, MEM_RESERVE, PAGE_NOACCESS);
+  pdp->pubScratch = (UBYTE *)malloc(slMaxBlock + 1);
+
+  if (pdp->pubBuffer == NULL || pdp->pubScratch == NULL
+   || !IZipWindow::Watch(pdp->pubBuffer, pdp->slReserved, &HandlePlayAccess, pdp)) {
+    if (pdp->pubBuffer != NULL) VirtualFree(pdp->pubBuffer, 0, MEM_RELEASE);
+    free(pdp->pubScratch);
+    free(pdp->pubFile);
+    delete pdp;
+
+    ThrowF_t(LOCALIZE("Cannot allocate memory for demo blocks in '%s'"), strFile.str_String);
+  }
+
+  strm.P_FreeBuffer();
+
+  const DOUBLE dStartTime = IStreamStats::Now();
+
+  strm.strm_pubBufferBegin = pdp->pubBuffer;
+  strm.strm_pubBufferEnd = pdp->pubBuffer + pdp->slReserved;
+  strm.strm_pubCurrentPos = pdp->pubBuffer;
+  strm.strm_pubMaxPos = pdp->pubBuffer;
+  strm.strm_pubEOF = pdp->pubBuffer + pdp->slSize;
+
+  IStreamStats::Allocated(&strm, pdp->slReserved, FALSE, dStartTime);
+  _pdpPlay = pdp;
+};
+
+// Free stream buffer if it's a demo that's being decompressed
+BOOL IDemoBlocks::Free(UBYTE *pubBuffer) {
+  if (_pdpPlay == NULL || _pdpPlay->pubBuffer != pubBuffer) return FALSE;
+
+  IZipWindow::Unwatch(pubBuffer);
+  VirtualFree(pubBuffer, 0, MEM_RELEASE);
+
+  free(_pdpPlay->pubScratch);
+  free(_pdpPlay->pubFile);
+  delete _pdpPlay;
+  _pdpPlay = NULL;
+  return TRUE;
+};
+
+#endif // _PATCHCONFIG_FIX_STREAMPAGING
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
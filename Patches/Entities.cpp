@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #if _PATCHCONFIG_EXTEND_ENTITIES && _PATCHCONFIG_ENGINEPATCHES
 
 #include "Entities.h"
+#include "UnpageStreams.h"
 #include "../MapConversion.h"
 
 #include <CoreLib/Interfaces/ResourceFunctions.h>
@@ -33,7 +34,10 @@ CEntityPatch::CGetForce pMovingBrush_GetForce = NULL;
 void CEntityPatch::P_ReadProperties(CTStream &istrm) {
   // Helper macros
   #define GET_PROP(_Type) ENTITYPROPERTY(this, pepProp->ep_slOffset, _Type)
-  #define READ_PROP(_Type) istrm.Read_t(&GET_PROP(_Type), sizeof(_Type))
+  #define READ_PROP(_Type) sc.Read_t(GET_PROP(_Type))
+
+  // [Cecil] Values that can only be read through the stream itself
+  #define READ_STREAM(_Read) { sc.Commit(); _Read; sc.Sync(); }
 
 #if _PATCHCONFIG_CONVERT_MAPS
   #define HANDLE_UNKNOWN(_Field) IMapConverter::HandleUnknownProperty(this, eptType, ulID, &_Field)
@@ -43,22 +47,25 @@ void CEntityPatch::P_ReadProperties(CTStream &istrm) {
 
   #define HANDLE_SIMPLE(_Type) { \
     _Type valSkip; \
-    istrm.Read_t(&valSkip, sizeof(_Type)); \
+    sc.Read_t(valSkip); \
     HANDLE_UNKNOWN(valSkip); \
   }
 
-  istrm.ExpectID_t("PRPS"); // Properties
+  // [Cecil] Read plain values directly from the buffer
+  CStreamCursor sc(istrm);
+
+  sc.ExpectID_t("PRPS"); // Properties
 
   CDLLEntityClass *pdecDLLClass = en_pecClass->ec_pdecDLLClass;
 
   // Read number of saved properties
   INDEX ctProperties;
-  istrm >> ctProperties;
+  sc.Read_t(ctProperties);
 
   while (--ctProperties >= 0) {
     // Packed identifier
     ULONG ulID;
-    istrm >> ulID;
+    sc.Read_t(ulID);
 
     // Unpack property type and property ID
     const CEntityProperty::PropertyType eptType = (CEntityProperty::PropertyType)(ulID & 0xFF);
@@ -83,69 +90,69 @@ void CEntityPatch::P_ReadProperties(CTStream &istrm) {
         case CEntityProperty::EPT_RANGE: case CEntityProperty::EPT_ANGLE:
         case CEntityProperty::EPT_ANIMATION: case CEntityProperty::EPT_ILLUMINATIONTYPE: {
           INDEX iDummy;
-          istrm >> iDummy;
+          sc.Read_t(iDummy);
           HANDLE_UNKNOWN(iDummy);
         } break;
 
         // [Cecil] Rev: 64-bit integer (EPT_U64)
         case 28: {
           __int64 iDummy;
-          istrm.Read_t(&iDummy, sizeof(iDummy));
+          sc.Read_t(iDummy);
           HANDLE_UNKNOWN(iDummy);
         } break;
 
         // [Cecil] Rev: DOUBLE written as FLOAT (EPT_DOUBLE)
         case 29: {
           FLOAT fDummy;
-          istrm >> fDummy;
+          sc.Read_t(fDummy);
           HANDLE_UNKNOWN(fDummy);
         } break;
 
         case CEntityProperty::EPT_ENTITYPTR: {
           CEntityPointer pen;
-          ReadEntityPointer_t(&istrm, pen);
+          READ_STREAM(ReadEntityPointer_t(&istrm, pen));
           HANDLE_UNKNOWN(pen);
         } break;
 
         case CEntityProperty::EPT_STRINGTRANS:
           // [Cecil] "DTRS" in the DLL as is gets picked up by the Depend utility
-          istrm.ExpectID_t((CTString("DT") + "RS").str_String);
+          sc.ExpectID_t((CTString("DT") + "RS").str_String);
         case CEntityProperty::EPT_FILENAMENODEP:
         case CEntityProperty::EPT_STRING: {
           CTString strDummy;
-          istrm >> strDummy;
+          sc.ReadString_t(strDummy);
           HANDLE_UNKNOWN(strDummy);
         } break;
 
         case CEntityProperty::EPT_FILENAME: {
           CTFileName fnmDummy;
-          istrm >> fnmDummy;
+          READ_STREAM(istrm >> fnmDummy);
           HANDLE_UNKNOWN(fnmDummy);
         } break;
 
         case CEntityProperty::EPT_MODELOBJECT: {
           CModelObject mo;
-          IRes::Models::Read_t(istrm, mo);
+          READ_STREAM(IRes::Models::Read_t(istrm, mo));
           HANDLE_UNKNOWN(mo);
         } break;
 
       #if SE1_VER >= SE1_107
         case CEntityProperty::EPT_MODELINSTANCE: {
           CModelInstance mi;
-          IRes::SKA::Read_t(istrm, mi);
+          READ_STREAM(IRes::SKA::Read_t(istrm, mi));
           HANDLE_UNKNOWN(mi);
         } break;
       #endif
 
         case CEntityProperty::EPT_ANIMOBJECT: {
           CAnimObject ao;
-          IRes::Anims::Read_t(istrm, ao);
+          READ_STREAM(IRes::Anims::Read_t(istrm, ao));
           HANDLE_UNKNOWN(ao);
         } break;
 
         case CEntityProperty::EPT_SOUNDOBJECT: {
           CSoundObject so;
-          so.Read_t(&istrm);
+          READ_STREAM(so.Read_t(&istrm));
           so.so_penEntity = this;
           HANDLE_UNKNOWN(so);
         } break;
@@ -182,41 +189,41 @@ void CEntityPatch::P_ReadProperties(CTStream &istrm) {
       case CEntityProperty::EPT_INDEX: case CEntityProperty::EPT_FLOAT:
       case CEntityProperty::EPT_RANGE: case CEntityProperty::EPT_ANGLE:
       case CEntityProperty::EPT_ANIMATION: case CEntityProperty::EPT_ILLUMINATIONTYPE: {
-        istrm >> GET_PROP(INDEX);
+        sc.Read_t(GET_PROP(INDEX));
       } break;
 
       // [Cecil] Rev: 64-bit integer (EPT_U64)
       case 28: {
         __int64 iValue;
-        istrm.Read_t(&iValue, sizeof(iValue));
+        sc.Read_t(iValue);
         GET_PROP(__int64) = iValue;
       } break;
 
       // [Cecil] Rev: DOUBLE written as FLOAT (EPT_DOUBLE)
       case 29: {
         FLOAT fValue;
-        istrm >> fValue;
+        sc.Read_t(fValue);
         GET_PROP(DOUBLE) = fValue;
       } break;
 
       // Entity pointer
       case CEntityProperty::EPT_ENTITYPTR: {
-        ReadEntityPointer_t(&istrm, GET_PROP(CEntityPointer));
+        READ_STREAM(ReadEntityPointer_t(&istrm, GET_PROP(CEntityPointer)));
       } break;
 
       // Translatable and normal strings
       case CEntityProperty::EPT_STRINGTRANS:
         // [Cecil] "DTRS" in the DLL as is gets picked up by the Depend utility
-        istrm.ExpectID_t((CTString("DT") + "RS").str_String);
+        sc.ExpectID_t((CTString("DT") + "RS").str_String);
       case CEntityProperty::EPT_FILENAMENODEP:
       case CEntityProperty::EPT_STRING: {
-        istrm >> GET_PROP(CTString);
+        sc.ReadString_t(GET_PROP(CTString));
       } break;
 
       // Resources
       case CEntityProperty::EPT_FILENAME: {
         CTFileName &fnm = GET_PROP(CTFileName);
-        istrm >> fnm;
+        READ_STREAM(istrm >> fnm);
 
         if (fnm == "") break;
 
@@ -238,22 +245,22 @@ void CEntityPatch::P_ReadProperties(CTStream &istrm) {
       } break;
 
       case CEntityProperty::EPT_MODELOBJECT: {
-        IRes::Models::Read_t(istrm, GET_PROP(CModelObject));
+        READ_STREAM(IRes::Models::Read_t(istrm, GET_PROP(CModelObject)));
       } break;
 
     #if SE1_VER >= SE1_107
       case CEntityProperty::EPT_MODELINSTANCE: {
-        IRes::SKA::Read_t(istrm, GET_PROP(CModelInstance));
+        READ_STREAM(IRes::SKA::Read_t(istrm, GET_PROP(CModelInstance)));
       } break;
     #endif
 
       case CEntityProperty::EPT_ANIMOBJECT: {
-        IRes::Anims::Read_t(istrm, GET_PROP(CAnimObject));
+        READ_STREAM(IRes::Anims::Read_t(istrm, GET_PROP(CAnimObject)));
       } break;
 
       case CEntityProperty::EPT_SOUNDOBJECT: {
         CSoundObject &so = GET_PROP(CSoundObject);
-        so.Read_t(&istrm);
+        READ_STREAM(so.Read_t(&istrm));
         so.so_penEntity = this;
       } break;
 
@@ -269,6 +276,8 @@ void CEntityPatch::P_ReadProperties(CTStream &istrm) {
       default: ASSERTALWAYS("Unknown property type");
     }
   }
+
+  sc.Commit();
 };
 
 // Send an event to this entity
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #if _PATCHCONFIG_ENGINEPATCHES
 
 #include "FileSystem.h"
+#include "UnpageStreams.h"
 #include "../MapConversion.h"
 
 #include <CoreLib/Base/Unzip.h>
@@ -268,18 +269,28 @@ void CStreamPatch::P_ReadDictionary_intenal(SLONG slOffset) {
     // Make space and read them
     strm_afnmDictionary.Push(ctNew);
 
+    // [Cecil] Read paths directly from the buffer
+    CStreamCursor sc(*this);
+
     for (INDEX i = ctOld; i < ctOld + ctNew; i++) {
       // Read path
       CTFileName &fnm = strm_afnmDictionary[i];
-      *this >> fnm;
+      sc.ReadString_t(fnm);
 
       // [Cecil] Fix Revolution directories
       IFiles::FixRevPath(fnm);
     }
+
+    sc.Commit();
   }
 
   ExpectID_t("DEND"); // Dictionary end
 
+  // [Cecil] Start loading new resources before they are needed
+  if (ctNew > 0) {
+    IPrefetch::Dictionary(strm_afnmDictionary, ctOld, ctNew);
+  }
+
   // Remember dictionary end position and return back
   strm_slDictionaryPos = GetPos_t();
   SetPos_t(slContinue);
@@ -349,6 +360,11 @@ static BOOL SetupGameDir(CTString &strGameDir, CTString &strDirProperty, const C
 void P_InitStreams(void) {
   BOOL bRev = FALSE;
 
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  // Decompressed entries may belong to archives that are about to be replaced
+  IZipCache::Clear();
+#endif
+
 #if TSE_FUSION_MODE
   // Setup other game directories
   if (IConfig::global[k_EConfigProps_TFEMount]) {
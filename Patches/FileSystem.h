@@ -57,6 +57,17 @@ class CStreamPatch : public CTStream {
     void P_ReadDictionary_intenal(SLONG slOffset);
 };
 
+// Warming up resources from stream dictionaries in the background
+namespace IPrefetch {
+
+// Resolve new dictionary filenames and start warming them up
+void Dictionary(CDynamicStackArray<CTFileName> &afnmDictionary, INDEX iFirst, INDEX ct);
+
+// Drop queued resources and stop all workers
+void Stop(void);
+
+}; // namespace
+
 // Initialize various file paths and load game content
 void P_InitStreams(void);
 
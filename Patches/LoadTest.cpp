@@ -0,0 +1,422 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Method for sending reliable packets to the server (replaced during load tests)
+CMessageDisPatch::CSendFunc ILoadTest::_pSendReliable = &CCommunicationInterface::Client_Send_Reliable;
+
+// Packet in the loopback link
+struct LoopbackPacket {
+  SLONG slOffset; // Where the packet is in the queue
+  SLONG slSize;
+};
+
+// Packets of one kind that have been sent by a simulated client
+struct LoopbackLink {
+  CStaticStackArray<UBYTE> aubQueue; // Sent packets one after another
+  CStaticStackArray<LoopbackPacket> aPackets;
+  INDEX iNextPacket; // Next packet for the server to receive
+
+  LoopbackLink() : iNextPacket(0) {};
+
+  // Start over with an empty link
+  void Reset(void) {
+    aubQueue.PopAll();
+    aPackets.PopAll();
+    iNextPacket = 0;
+  };
+
+  // Add sent packet
+  void Send(const void *pvSend, SLONG slSize) {
+    LoopbackPacket &pck = aPackets.Push();
+    pck.slOffset = aubQueue.Count();
+    pck.slSize = slSize;
+
+    memcpy(aubQueue.Push(slSize), pvSend, slSize);
+  };
+
+  // Take the next packet
+  BOOL Receive(void *pvReceive, SLONG &slSize) {
+    if (iNextPacket >= aPackets.Count()) return FALSE;
+
+    const LoopbackPacket &pck = aPackets[iNextPacket];
+
+    // Doesn't fit
+    if (pck.slSize > slSize) return FALSE;
+
+    iNextPacket++;
+    memcpy(pvReceive, &aubQueue[pck.slOffset], pck.slSize);
+    slSize = pck.slSize;
+    return TRUE;
+  };
+};
+
+// Simulated client
+struct SimClient {
+  INDEX iSession; // Session that the client is using
+  LoopbackLink linkReliable;
+  LoopbackLink linkUnreliable;
+  BOOL bJoined; // Session state has been sent to it
+  DOUBLE dSent; // When the actions of the current tick have been sent
+
+  ULONG ulRandom; // State of synthetic actions
+  DOUBLE dCPU; // Time spent on this client
+};
+
+static CStaticArray<SimClient> _aSimClients;
+
+// Simulated client using each session (-1 if none)
+static CStaticArray<INDEX> _aiSessionClients;
+
+// Simulated client that's sending packets to the server
+static INDEX _iSendingClient = -1;
+
+// Packets of simulated clients
+static INDEX _ctSent = 0;
+static INDEX _ctReceived = 0;
+static __int64 _llSentBytes = 0;
+static __int64 _llReceivedBytes = 0;
+
+// Time from sending actions until the server has handled them
+static DOUBLE _dLatencySum = 0.0;
+static DOUBLE _dLatencyMax = 0.0;
+static INDEX _ctMeasured = 0;
+
+// Current time for measuring
+static inline DOUBLE LoadTestTime(void) {
+  return _pTimer->GetHighPrecisionTimer().GetSeconds();
+};
+
+// Get simulated client in some session
+static SimClient *SessionClient(INDEX iSession) {
+  if (iSession < 0 || iSession >= _aiSessionClients.Count()) return NULL;
+  if (_aiSessionClients[iSession] == -1) return NULL;
+
+  return &_aSimClients[_aiSessionClients[iSession]];
+};
+
+// In-memory stand-in for the communication interface
+// [Cecil] NOTE: Its methods are called on the real interface, so they may only use static data
+class CLoopbackComm : public CCommunicationInterface {
+  public:
+    // Send a reliable packet from the current simulated client
+    void Client_Send_Loopback(const void *pvSend, SLONG slSize) {
+      ASSERT(_iSendingClient != -1);
+      _aSimClients[_iSendingClient].linkReliable.Send(pvSend, slSize);
+
+      _ctSent++;
+      _llSentBytes += slSize;
+    };
+
+    // Receive the next reliable packet from a simulated client in some session
+    BOOL Server_Receive_LoopbackReliable(INDEX iClient, void *pvReceive, SLONG &slSize) {
+      SimClient *psc = SessionClient(iClient);
+      return (psc != NULL && psc->linkReliable.Receive(pvReceive, slSize));
+    };
+
+    // Receive the next unreliable packet from a simulated client in some session
+    BOOL Server_Receive_Loopback(INDEX iClient, void *pvReceive, SLONG &slSize) {
+      SimClient *psc = SessionClient(iClient);
+      return (psc != NULL && psc->linkUnreliable.Receive(pvReceive, slSize));
+    };
+};
+
+// Send an unreliable message from a simulated client through the loopback link
+static void SendFromClient(SimClient &sc, const CNetworkMessage &nmMessage) {
+  sc.linkUnreliable.Send(nmMessage.nm_pubMessage, nmMessage.nm_slSize);
+
+  _ctSent++;
+  _llSentBytes += nmMessage.nm_slSize;
+};
+
+// Generate synthetic actions of a simulated client for one tick
+static void SendActions(SimClient &sc, INDEX iTick) {
+  sc.ulRandom = sc.ulRandom * 1103515245 + 12345;
+  const FLOAT fRandom = FLOAT(sc.ulRandom >> 16) / 65535.0f;
+
+  CPlayerAction pa;
+  pa.Clear();
+  pa.pa_vTranslation = FLOAT3D(fRandom * 10.0f, 0.0f, -10.0f);
+  pa.pa_aRotation = ANGLE3D(fRandom * 5.0f, 0.0f, 0.0f);
+  pa.pa_aViewRotation = pa.pa_aRotation;
+  pa.pa_ulButtons = (sc.ulRandom >> 8) & 0xFF;
+  pa.pa_llCreated = iTick;
+
+  CNetworkMessage nmAction(MSG_ACTIONPREDICT);
+  nmAction << iTick;
+  nmAction.Write(&pa, sizeof(pa));
+
+  SendFromClient(sc, nmAction);
+  sc.dSent = LoadTestTime();
+};
+
+// Request session state from the server like a connecting client
+static void RequestSessionState(INDEX iClient) {
+  CNetworkMessage nmRequest(MSG_REQ_CONNECTREMOTESESSIONSTATE);
+  nmRequest << INDEX(_SE_BUILD_MAJOR);
+  nmRequest << INDEX(_SE_BUILD_MINOR);
+  nmRequest << CTString(""); // Connect password
+  nmRequest << CTString(""); // VIP password
+
+  // Through the client's usual path that also adds the patch tag
+  _iSendingClient = iClient;
+  ((CMessageDisPatch *)_pNetwork)->P_SendToServerReliable(nmRequest);
+  _iSendingClient = -1;
+};
+
+// Serialize and pack the session state for a simulated client, then unpack it on its side
+// [Cecil] NOTE: Client that's being handled is still set by the server after receiving its request
+static void JoinClient(SimClient &sc) {
+  CTMemoryStream strmState;
+  _pNetwork->ga_sesSessionState.Write_t(&strmState);
+  strmState.SetPos_t(0);
+
+  CzlibCompressor comp;
+  CTMemoryStream strmPacked;
+  comp.PackStream_t(strmState, strmPacked);
+  strmPacked.SetPos_t(0);
+
+  CTMemoryStream strmUnpacked;
+  comp.UnpackStream_t(strmPacked, strmUnpacked);
+
+  sc.bJoined = TRUE;
+};
+
+// Run a server with simulated clients through an in-memory link
+void ILoadTest::Run(void *pArgs) {
+  INDEX ctClients = NEXTARGUMENT(INDEX);
+  INDEX ctTicks = NEXTARGUMENT(INDEX);
+  ctClients = Clamp(ctClients, (INDEX)1, (INDEX)256);
+  ctTicks = Clamp(ctTicks, (INDEX)1, (INDEX)100000);
+
+  CNetworkLibrary &nl = *_pNetwork;
+
+  if (!nl.IsServer()) {
+    CPutString(TRANS("Start a server before running a load test!\n"));
+    return;
+  }
+
+  CTSingleLock slNetwork(&nl.ga_csNetwork, TRUE);
+  CServer &srv = nl.ga_srvServer;
+
+  // [Cecil] NOTE: Synthetic packets go through INetwork::ServerHandle() like real ones, which may record
+  // information about the sessions that simulated clients are using and may send replies to them.
+  // Replies to inactive sessions go nowhere and the information is reset once a real client connects,
+  // but real clients could be affected by everything else, so the test only runs on an otherwise empty server.
+  const INDEX ctSessions = srv.srv_assoSessions.Count();
+
+  for (INDEX iSession = 1; iSession < ctSessions; iSession++) {
+    if (srv.srv_assoSessions[iSession].sso_bActive) {
+      CPutString(TRANS("Disconnect all clients before running a load test!\n"));
+      return;
+    }
+  }
+
+  // Simulated clients connect through sessions that aren't used by anyone
+  _aiSessionClients.Clear();
+  _aiSessionClients.New(ctSessions);
+
+  CStaticStackArray<INDEX> aiFreeSessions;
+
+  for (INDEX iSession = 0; iSession < ctSessions; iSession++) {
+    _aiSessionClients[iSession] = -1;
+
+    if (iSession > 0) aiFreeSessions.Push() = iSession;
+  }
+
+  if (aiFreeSessions.Count() == 0) {
+    CPutString(TRANS("No free sessions for simulated clients!\n"));
+    return;
+  }
+
+  // One client per session
+  ctClients = Min(ctClients, (INDEX)aiFreeSessions.Count());
+
+  _aSimClients.Clear();
+  _aSimClients.New(ctClients);
+
+  for (INDEX iClient = 0; iClient < ctClients; iClient++) {
+    SimClient &sc = _aSimClients[iClient];
+    sc.iSession = aiFreeSessions[iClient];
+    sc.bJoined = FALSE;
+    sc.dSent = 0.0;
+    sc.ulRandom = 0x5EED + iClient;
+    sc.dCPU = 0.0;
+
+    _aiSessionClients[sc.iSession] = iClient;
+  }
+
+  _ctSent = 0;
+  _ctReceived = 0;
+  _llSentBytes = 0;
+  _llReceivedBytes = 0;
+  _dLatencySum = 0.0;
+  _dLatencyMax = 0.0;
+  _ctMeasured = 0;
+
+  const INDEX iOldHandlingClient = IProcessPacket::_iHandlingClient;
+  DOUBLE dJoinTime = 0.0;
+
+  // Synthetic traffic shouldn't end up in the statistics of the actual server
+  const INDEX bOldTrafficStats = ITrafficStats::_bEnabled;
+  ITrafficStats::_bEnabled = FALSE;
+
+  // Clients send and the server receives packets of simulated clients through the usual path
+  CMessageDisPatch &md = (CMessageDisPatch &)nl;
+  _pSendReliable = static_cast<CMessageDisPatch::CSendFunc>(&CLoopbackComm::Client_Send_Loopback);
+
+  IPacketQueue::OverrideReceiveFunc(IPacketQueue::E_RELIABLE,
+    static_cast<CMessageDisPatch::CReceiveFunc>(&CLoopbackComm::Server_Receive_LoopbackReliable));
+  IPacketQueue::OverrideReceiveFunc(IPacketQueue::E_UNRELIABLE,
+    static_cast<CMessageDisPatch::CReceiveFunc>(&CLoopbackComm::Server_Receive_Loopback));
+
+  CPrintF(TRANS("Load test: %d clients, %d ticks\n"), ctClients, ctTicks);
+
+  INDEX ctJoined = 0;
+
+  try {
+    CNetworkMessage nmReceived;
+
+    // All clients join at once, like after a map change
+    const DOUBLE dJoinStart = LoadTestTime();
+
+    for (INDEX iClient = 0; iClient < ctClients; iClient++) {
+      const DOUBLE dStart = LoadTestTime();
+      RequestSessionState(iClient);
+      _aSimClients[iClient].dCPU += LoadTestTime() - dStart;
+    }
+
+    for (INDEX iClient = 0; iClient < ctClients; iClient++) {
+      SimClient &sc = _aSimClients[iClient];
+      const DOUBLE dStart = LoadTestTime();
+
+      // Same as the engine's loop for reliable packets in CServer::ServerLoop()
+      while (md.P_ReceiveFromClientReliable(sc.iSession, nmReceived)) {
+        _ctReceived++;
+        _llReceivedBytes += nmReceived.nm_slSize;
+
+        // Send session state instead of the engine's CServer::Handle()
+        if (nmReceived.GetType() == MSG_REQ_CONNECTREMOTESESSIONSTATE) {
+          JoinClient(sc);
+          ctJoined++;
+        }
+      }
+
+      sc.linkReliable.Reset();
+      sc.dCPU += LoadTestTime() - dStart;
+    }
+
+    dJoinTime = LoadTestTime() - dJoinStart;
+
+    if (ctJoined == 0) {
+      ThrowF_t(LOCALIZE("Server hasn't accepted any simulated clients"));
+    }
+
+    const DOUBLE dStart = LoadTestTime();
+
+    for (INDEX iTick = 0; iTick < ctTicks; iTick++) {
+      // Clients send their actions
+      for (INDEX iClient = 0; iClient < ctClients; iClient++) {
+        SimClient &sc = _aSimClients[iClient];
+        if (!sc.bJoined) continue;
+
+        const DOUBLE dClientStart = LoadTestTime();
+
+        SendActions(sc, iTick);
+
+        sc.dCPU += LoadTestTime() - dClientStart;
+      }
+
+      // Server receives them
+      for (INDEX iClient = 0; iClient < ctClients; iClient++) {
+        SimClient &sc = _aSimClients[iClient];
+        if (!sc.bJoined) continue;
+
+        const DOUBLE dClientStart = LoadTestTime();
+
+        // Same as the engine's loop for unreliable packets in CServer::ServerLoop()
+        while (md.P_ReceiveFromClient(sc.iSession, nmReceived)) {
+          _ctReceived++;
+          _llReceivedBytes += nmReceived.nm_slSize;
+
+          // Actions aren't applied because simulated clients have no players
+          if (nmReceived.GetType() != MSG_ACTIONPREDICT) continue;
+
+          INDEX iSentTick;
+          CPlayerAction pa;
+          nmReceived >> iSentTick;
+          nmReceived.Read(&pa, sizeof(pa));
+
+          // Measure latency from sending actions to handling them
+          if (iSentTick == iTick) {
+            const DOUBLE dLatency = LoadTestTime() - sc.dSent;
+            _dLatencySum += dLatency;
+            _dLatencyMax = Max(_dLatencyMax, dLatency);
+            _ctMeasured++;
+          }
+        }
+
+        // Start over with an empty link
+        sc.linkUnreliable.Reset();
+
+        sc.dCPU += LoadTestTime() - dClientStart;
+      }
+    }
+
+    const DOUBLE dTotal = ClampDn(LoadTestTime() - dStart, 1e-6);
+
+    DOUBLE dCPU = 0.0;
+
+    for (INDEX iClient = 0; iClient < ctClients; iClient++) {
+      dCPU += _aSimClients[iClient].dCPU;
+    }
+
+    CPrintF(TRANS("  %.1f ticks/s\n"), ctTicks / dTotal);
+    CPrintF(TRANS("  packets: %d sent (%I64d bytes), %d received (%I64d bytes)\n"),
+      _ctSent, _llSentBytes, _ctReceived, _llReceivedBytes);
+    CPrintF(TRANS("  action latency: %.3f us avg, %.3f us max\n"),
+      (_ctMeasured > 0 ? _dLatencySum / _ctMeasured : 0.0) * 1e6, _dLatencyMax * 1e6);
+    CPrintF(TRANS("  CPU per client: %.3f ms total, %.3f us per tick\n"),
+      dCPU / ctJoined * 1e3, dCPU / ctJoined / ctTicks * 1e6);
+
+    CPrintF(TRANS("  joins: %d of %d, %.3f ms avg, %.3f ms total\n"),
+      ctJoined, ctClients, dJoinTime / ctClients * 1e3, dJoinTime * 1e3);
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Load test failed:\n%s\n"), strError);
+  }
+
+  _pSendReliable = &CCommunicationInterface::Client_Send_Reliable;
+  _iSendingClient = -1;
+
+  IPacketQueue::OverrideReceiveFunc(IPacketQueue::E_RELIABLE, NULL);
+  IPacketQueue::OverrideReceiveFunc(IPacketQueue::E_UNRELIABLE, NULL);
+  ITrafficStats::_bEnabled = bOldTrafficStats;
+
+  IProcessPacket::_iHandlingClient = iOldHandlingClient;
+  _aSimClients.Clear();
+  _aiSessionClients.Clear();
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
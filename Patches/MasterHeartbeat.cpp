@@ -0,0 +1,290 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK && _PATCHCONFIG_NEW_QUERY
+
+// Update master server on a separate thread instead of every game tick
+// [Cecil] NOTE: Master server update also answers queries from server browsers, which
+// are only answered as often as the heartbeat interval when it's done on the thread
+INDEX IMasterHeartbeat::_bThreaded = FALSE;
+
+// How often to update master server from the thread (in seconds)
+FLOAT IMasterHeartbeat::_fInterval = 2.0f;
+
+// Access to the master server from any thread
+CTCriticalSection IMasterHeartbeat::_csMaster;
+
+// Server status published by the game thread
+static LONG _lServing = FALSE;
+
+// Heartbeat thread
+static HANDLE _hThread = NULL;
+static HANDLE _hQuit = NULL;
+
+// Update master server periodically while the server is running
+static DWORD WINAPI HeartbeatThread(LPVOID) {
+  FOREVER {
+    const DWORD dwWait = DWORD(Clamp(IMasterHeartbeat::_fInterval, 0.5f, 60.0f) * 1000.0f);
+
+    // Quit or update
+    if (WaitForSingleObject(_hQuit, dwWait) != WAIT_TIMEOUT) break;
+
+    if (!_lServing) continue;
+
+    CTSingleLock slMaster(&IMasterHeartbeat::_csMaster, TRUE);
+
+    // Server may have stopped while waiting for the lock
+    if (!_lServing) continue;
+
+    // Don't stall the game thread while it's processing the game and try again later
+    CTSingleLock slNetwork(&_pNetwork->ga_csNetwork, FALSE);
+    if (!slNetwork.TryToLock()) continue;
+
+    IMasterServer::OnServerUpdate();
+  }
+
+  return 0;
+};
+
+// Start the heartbeat thread
+static void StartThread(void) {
+  _hQuit = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+  DWORD dwThreadID;
+  _hThread = CreateThread(NULL, 0, &HeartbeatThread, NULL, 0, &dwThreadID);
+
+  if (_hThread == NULL) {
+    CloseHandle(_hQuit);
+    _hQuit = NULL;
+    return;
+  }
+
+  SetThreadPriority(_hThread, THREAD_PRIORITY_BELOW_NORMAL);
+};
+
+// Publish server status from the game thread and update master server if it's not threaded
+void IMasterHeartbeat::Publish(BOOL bServing) {
+  // Update from the game thread every tick
+  if (!_bThreaded) {
+    InterlockedExchange(&_lServing, FALSE);
+
+    if (bServing) {
+      CTSingleLock slMaster(&_csMaster, TRUE);
+      IMasterServer::OnServerUpdate();
+    }
+    return;
+  }
+
+  InterlockedExchange(&_lServing, bServing);
+
+  if (bServing && _hThread == NULL) {
+    StartThread();
+  }
+};
+
+// Stop updating master server from the thread until the next publish
+void IMasterHeartbeat::Suspend(void) {
+  InterlockedExchange(&_lServing, FALSE);
+};
+
+// Stop the heartbeat thread
+void IMasterHeartbeat::Stop(void) {
+  InterlockedExchange(&_lServing, FALSE);
+
+  if (_hThread == NULL) return;
+
+  SetEvent(_hQuit);
+  WaitForSingleObject(_hThread, INFINITE);
+
+  CloseHandle(_hThread);
+  CloseHandle(_hQuit);
+  _hThread = NULL;
+  _hQuit = NULL;
+};
+
+// Packets received by the local stand-in master server
+struct LocalMasterStats {
+  INDEX ctPackets;
+  __int64 llBytes;
+  DOUBLE dFirst; // When the first packet has been received
+  DOUBLE dLast; // When the last packet has been received
+  DOUBLE dMaxGap; // Longest time between two packets
+  sockaddr_in addrLast; // Sender of the last packet
+  char strLast[64]; // Beginning of the last packet
+};
+
+static LocalMasterStats _lms;
+static CTCriticalSection _csLocalMaster;
+
+// Local stand-in master server thread
+static SOCKET _sockLocalMaster = INVALID_SOCKET;
+static HANDLE _hLocalMaster = NULL;
+static HANDLE _hLocalMasterQuit = NULL;
+
+// Current time for the local master server
+static DOUBLE LocalMasterTime(void) {
+  return _pTimer->GetHighPrecisionTimer().GetSeconds();
+};
+
+// Receive packets sent to the local master server
+static DWORD WINAPI LocalMasterThread(LPVOID) {
+  char aBuffer[2048];
+
+  while (WaitForSingleObject(_hLocalMasterQuit, 0) == WAIT_TIMEOUT) {
+    // Check for the quit event every now and then
+    fd_set fdsRead;
+    FD_ZERO(&fdsRead);
+    FD_SET(_sockLocalMaster, &fdsRead);
+
+    timeval tvWait = { 0, 100000 };
+    if (select(0, &fdsRead, NULL, NULL, &tvWait) <= 0) continue;
+
+    sockaddr_in addrFrom;
+    int iFromLength = sizeof(addrFrom);
+
+    const int iReceived = recvfrom(_sockLocalMaster, aBuffer, sizeof(aBuffer), 0, (sockaddr *)&addrFrom, &iFromLength);
+    if (iReceived <= 0) continue;
+
+    const DOUBLE dNow = LocalMasterTime();
+    CTSingleLock slStats(&_csLocalMaster, TRUE);
+
+    if (_lms.ctPackets == 0) {
+      _lms.dFirst = dNow;
+    } else {
+      _lms.dMaxGap = Max(_lms.dMaxGap, dNow - _lms.dLast);
+    }
+
+    _lms.ctPackets++;
+    _lms.llBytes += iReceived;
+    _lms.dLast = dNow;
+    _lms.addrLast = addrFrom;
+
+    // Keep it printable
+    INDEX ctChars = Min(iReceived, INDEX(sizeof(_lms.strLast) - 1));
+
+    for (INDEX i = 0; i < ctChars; i++) {
+      const UBYTE ub = aBuffer[i];
+      _lms.strLast[i] = (ub >= 32 && ub < 127) ? ub : '.';
+    }
+
+    _lms.strLast[ctChars] = '\0';
+  }
+
+  return 0;
+};
+
+// Start receiving heartbeats on a local port instead of a real master server
+void IMasterHeartbeat::StartLocalMaster(void *pArgs) {
+  INDEX iPort = NEXTARGUMENT(INDEX);
+  StopLocalMaster();
+
+  WSADATA wsaData;
+
+  if (WSAStartup(MAKEWORD(1, 1), &wsaData) != 0) {
+    CPutString(TRANS("Cannot initialize sockets for the local master server!\n"));
+    return;
+  }
+
+  _sockLocalMaster = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  if (_sockLocalMaster == INVALID_SOCKET) {
+    CPutString(TRANS("Cannot create a socket for the local master server!\n"));
+    WSACleanup();
+    return;
+  }
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((u_short)iPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(_sockLocalMaster, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    CPrintF(TRANS("Cannot start the local master server on port %d!\n"), iPort);
+    StopLocalMaster();
+    return;
+  }
+
+  memset(&_lms, 0, sizeof(_lms));
+  _hLocalMasterQuit = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+  DWORD dwThreadID;
+  _hLocalMaster = CreateThread(NULL, 0, &LocalMasterThread, NULL, 0, &dwThreadID);
+
+  if (_hLocalMaster == NULL) {
+    CPutString(TRANS("Cannot start the local master server thread!\n"));
+    StopLocalMaster();
+    return;
+  }
+
+  CPrintF(TRANS("Local master server is listening on 127.0.0.1:%d\n"), iPort);
+  CPutString(TRANS("Point the master server address to it and check received heartbeats with ser_LocalMasterStatus()\n"));
+};
+
+// Print heartbeats received by the local master server
+void IMasterHeartbeat::PrintLocalMaster(void) {
+  if (_hLocalMaster == NULL) {
+    CPutString(TRANS("Local master server isn't running!\n"));
+    return;
+  }
+
+  LocalMasterStats lms;
+
+  {
+    CTSingleLock slStats(&_csLocalMaster, TRUE);
+    lms = _lms;
+  }
+
+  CPrintF(TRANS("Received packets: %d (%d bytes)\n"), lms.ctPackets, INDEX(lms.llBytes));
+  if (lms.ctPackets == 0) return;
+
+  const DOUBLE dNow = LocalMasterTime();
+  const DOUBLE dAverage = (lms.ctPackets > 1) ? (lms.dLast - lms.dFirst) / (lms.ctPackets - 1) : 0.0;
+
+  CPrintF(TRANS("Last packet: %.2fs ago from %s:%d\n  %s\n"), dNow - lms.dLast,
+    inet_ntoa(lms.addrLast.sin_addr), ntohs(lms.addrLast.sin_port), lms.strLast);
+  CPrintF(TRANS("Average interval: %.2fs, longest: %.2fs\n"), dAverage, lms.dMaxGap);
+};
+
+// Stop the local master server
+void IMasterHeartbeat::StopLocalMaster(void) {
+  if (_hLocalMaster != NULL) {
+    SetEvent(_hLocalMasterQuit);
+    WaitForSingleObject(_hLocalMaster, INFINITE);
+    CloseHandle(_hLocalMaster);
+    _hLocalMaster = NULL;
+  }
+
+  if (_hLocalMasterQuit != NULL) {
+    CloseHandle(_hLocalMasterQuit);
+    _hLocalMasterQuit = NULL;
+  }
+
+  if (_sockLocalMaster != INVALID_SOCKET) {
+    closesocket(_sockLocalMaster);
+    _sockLocalMaster = INVALID_SOCKET;
+    WSACleanup();
+  }
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK && _PATCHCONFIG_NEW_QUERY
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
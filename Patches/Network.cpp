@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #if _PATCHCONFIG_ENGINEPATCHES
 
 #include "Network.h"
+#include "UnpageStreams.h"
 
 #include <CoreLib/Query/QueryManager.h>
 #include <CoreLib/Networking/NetworkFunctions.h>
@@ -42,6 +43,7 @@ void CComIntPatch::P_EndWinsock(void) {
       CPutString("CCommunicationInterface::EndWinsock() -> IMasterServer::EnumCancel()\n");
     }
 
+    CTSingleLock slMaster(&IMasterHeartbeat::_csMaster, TRUE);
     IMasterServer::EnumCancel();
   }
 
@@ -64,8 +66,11 @@ void CComIntPatch::P_ServerInit(void) {
   // Proceed to the original function
   (this->*pServerInit)();
 
+  IPacketQueue::Clear();
+
 #if _PATCHCONFIG_GUID_MASKING
   IProcessPacket::ClearSyncChecks();
+  IPlayerMap::Invalidate();
 #endif
 
 #if _PATCHCONFIG_NEW_QUERY
@@ -80,6 +85,7 @@ void CComIntPatch::P_ServerInit(void) {
   static CSymbolPtr symptr("ser_bEnumeration");
 
   if (symptr.GetIndex() && GetComm().IsNetworkEnabled()) {
+    CTSingleLock slMaster(&IMasterHeartbeat::_csMaster, TRUE);
     IMasterServer::OnServerStart();
   }
 #endif // _PATCHCONFIG_NEW_QUERY
@@ -89,8 +95,11 @@ void CComIntPatch::P_ServerClose(void) {
   // Proceed to the original function
   (this->*pServerClose)();
 
+  IPacketQueue::Clear();
+
 #if _PATCHCONFIG_GUID_MASKING
   IProcessPacket::ClearSyncChecks();
+  ISyncCheck::Stop();
 #endif
 
 #if _PATCHCONFIG_NEW_QUERY
@@ -104,7 +113,11 @@ void CComIntPatch::P_ServerClose(void) {
   // Stop new master server
   static CSymbolPtr symptr("ser_bEnumeration");
 
+  // Don't update it from the heartbeat thread anymore
+  IMasterHeartbeat::Suspend();
+
   if (symptr.GetIndex()) {
+    CTSingleLock slMaster(&IMasterHeartbeat::_csMaster, TRUE);
     IMasterServer::OnServerEnd();
   }
 #endif // _PATCHCONFIG_NEW_QUERY
@@ -121,7 +134,11 @@ void CMessageDisPatch::P_SendToServerReliable(const CNetworkMessage &nmMessage)
     nmWriteable << (ULONG)ClassicsCore_GetVersion();
   }
 
-  GetComm().Client_Send_Reliable((void *)nmMessage.nm_pubMessage, nmMessage.nm_slSize);
+  // [Cecil] Send through the current method
+  (GetComm().*ILoadTest::_pSendReliable)((void *)nmMessage.nm_pubMessage, nmMessage.nm_slSize);
+
+  // [Cecil] Count sent messages
+  ITrafficStats::Count(ITrafficStats::ETD_SENT, nmMessage);
 
   // Relevant inline reimplementation of UpdateSentMessageStats()
   static CSymbolPtr pbReport("net_bReportTraffic");
@@ -159,9 +176,24 @@ BOOL CMessageDisPatch::ReceiveFromClientSpecific(INDEX iClient, CNetworkMessage
 // Server receives a packet
 BOOL CMessageDisPatch::P_ReceiveFromClient(INDEX iClient, CNetworkMessage &nmMessage) {
   FOREVER {
+    // [Cecil] Previous packet has been handled by now, including by the engine, so it's not for any client anymore
+    IProcessPacket::_iHandlingClient = IProcessPacket::CLT_NONE;
+
+    // [Cecil] Take packets from the ones that have been received from all clients at once
+    BOOL bReceived;
+
+    if (IPacketQueue::IsActive()) {
+      bReceived = IPacketQueue::Receive(iClient, IPacketQueue::E_UNRELIABLE, nmMessage);
+    } else {
+      bReceived = ReceiveFromClientSpecific(iClient, nmMessage, IPacketQueue::ReceiveFunc(IPacketQueue::E_UNRELIABLE));
+    }
+
     // Process unreliable message
-    if (ReceiveFromClientSpecific(iClient, nmMessage, &CCommunicationInterface::Server_Receive_Unreliable)) {
-      // Set client that's being handled
+    if (bReceived) {
+      // [Cecil] Count received messages
+      ITrafficStats::Count(ITrafficStats::ETD_RECEIVED, nmMessage);
+
+      // Set client that's being handled (also while the engine is handling it)
       IProcessPacket::_iHandlingClient = iClient;
       BOOL bPass = INetwork::ServerHandle(this, iClient, nmMessage);
 
@@ -181,9 +213,24 @@ BOOL CMessageDisPatch::P_ReceiveFromClient(INDEX iClient, CNetworkMessage &nmMes
 // Server receives a reliable packet
 BOOL CMessageDisPatch::P_ReceiveFromClientReliable(INDEX iClient, CNetworkMessage &nmMessage) {
   FOREVER {
+    // [Cecil] Previous packet has been handled by now, including by the engine, so it's not for any client anymore
+    IProcessPacket::_iHandlingClient = IProcessPacket::CLT_NONE;
+
+    // [Cecil] Take packets from the ones that have been received from all clients at once
+    BOOL bReceived;
+
+    if (IPacketQueue::IsActive()) {
+      bReceived = IPacketQueue::Receive(iClient, IPacketQueue::E_RELIABLE, nmMessage);
+    } else {
+      bReceived = ReceiveFromClientSpecific(iClient, nmMessage, IPacketQueue::ReceiveFunc(IPacketQueue::E_RELIABLE));
+    }
+
     // Process reliable message
-    if (ReceiveFromClientSpecific(iClient, nmMessage, &CCommunicationInterface::Server_Receive_Reliable)) {
-      // Set client that's being handled
+    if (bReceived) {
+      // [Cecil] Count received messages
+      ITrafficStats::Count(ITrafficStats::ETD_RECEIVED, nmMessage);
+
+      // Set client that's being handled (also while the engine is handling it)
       IProcessPacket::_iHandlingClient = iClient;
       BOOL bPass = INetwork::ServerHandle(this, iClient, nmMessage);
 
@@ -234,11 +281,15 @@ void CNetworkPatch::P_ChangeLevelInternal(void) {
   // Proceed to the original function
   (this->*pChangeLevel)();
 
+  IStateCache::Invalidate();
+
 #if _PATCHCONFIG_GUID_MASKING
   // Clear sync checks for each client on a new level
   if (IsServer()) {
     IProcessPacket::ClearSyncChecks();
   }
+
+  IPlayerMap::Invalidate();
 #endif // _PATCHCONFIG_GUID_MASKING
 
   // Change level for Core
@@ -261,6 +312,23 @@ void CNetworkPatch::P_Save(const CTFileName &fnmGame) {
   // [Cecil] Write server info
   SerializeServerInfoNow serInfo;
 
+  // [Cecil] Take a snapshot of the game and write it in the background
+  if (IAsyncSave::_bEnabled) {
+    CTMemoryStream strmGame;
+    strmGame.WriteID_t("GAME");
+    ga_sesSessionState.Write_t(&strmGame);
+    strmGame.WriteID_t("GEND"); // Game end
+
+    // Don't block the network while writing
+    slNetwork.Unlock();
+
+    // Reported to Core when written
+    if (IAsyncSave::Write(fnmGame, strmGame)) return;
+
+    // Couldn't take the snapshot, so write the game right away
+    slNetwork.Lock();
+  }
+
   // Create the file
   CTFileStream strmFile;
   strmFile.Create_t(fnmGame);
@@ -276,6 +344,9 @@ void CNetworkPatch::P_Save(const CTFileName &fnmGame) {
 
 // Load saved game
 void CNetworkPatch::P_Load(const CTFileName &fnmGame) {
+  // [Cecil] Finish writing saved games
+  IAsyncSave::Wait();
+
   // Reset data and read server info
   IProcessPacket::ResetSessionData(FALSE); // Load game
   SerializeServerInfoNow serInfo;
@@ -289,12 +360,19 @@ void CNetworkPatch::P_Load(const CTFileName &fnmGame) {
 
 // Stop current game
 void CNetworkPatch::P_StopGame(void) {
+  // [Cecil] Finish writing saved games
+  IAsyncSave::Wait();
+
   // Stop game for Core
   IHooks::OnGameStop();
 
   // Proceed to the original function
   (this->*pStopGame)();
 
+  // [Cecil] Demos are stopped along with the game
+  IDemoSeek::StopRecording();
+  IDemoSeek::Clear();
+
   // Make sure there is enough space for local players
   ga_aplsPlayers.Clear();
   ga_aplsPlayers.New(ICore::MAX_LOCAL_PLAYERS);
@@ -328,6 +406,13 @@ void CNetworkPatch::P_StartDemoPlay(const CTFileName &fnDemo) {
   // Proceed to the original function
   (this->*pStartDemoPlay)(fnDemo);
 
+  // [Cecil] Allow seeking through the demo
+  IDemoSeek::Load(fnDemo);
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::SetOwner(&ga_strmDemoPlay, IStreamStats::EBO_DEMO);
+#endif
+
   // Play demo for Core
   IHooks::OnDemoPlay(fnDemo);
 };
@@ -348,6 +433,13 @@ void CNetworkPatch::P_StartDemoRec(const CTFileName &fnDemo) {
   // Create the file
   ga_strmDemoRec.Create_t(fnDemo);
 
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::SetOwner(&ga_strmDemoRec, IStreamStats::EBO_DEMO);
+
+  // Write the demo to disk as it's being recorded
+  IDemoBlocks::Start(ga_strmDemoRec);
+#endif
+
   // Write initial info to stream
   ga_strmDemoRec.WriteID_t("DEMO");
   ga_strmDemoRec.WriteID_t("MVER");
@@ -357,6 +449,9 @@ void CNetworkPatch::P_StartDemoRec(const CTFileName &fnDemo) {
   // Set demo recording state
   ga_bDemoRec = TRUE;
 
+  // [Cecil] Take snapshots for seeking through the demo
+  IDemoSeek::StartRecording(fnDemo);
+
   // [Cecil] Start demo recording for Core
   IHooks::OnDemoStart(fnDemo);
 };
@@ -373,6 +468,8 @@ void CNetworkPatch::P_StopDemoRec(void) {
   ga_strmDemoRec.WriteID_t("DEND"); // Demo end
   ga_strmDemoRec.Close();
 
+  IDemoSeek::StopRecording();
+
   // Set demo recording state
   ga_bDemoRec = FALSE;
 
@@ -384,24 +481,55 @@ void CSessionStatePatch::P_FlushProcessedPredictions(void) {
   // Proceed to the original function
   (this->*pFlushPredictions)();
 
+  // Report saved games that have been written
+  IAsyncSave::Update();
+
+  // Roll up network traffic
+  ITrafficStats::Update();
+
+  if (_pNetwork->ga_bDemoRec) {
+    // Take snapshots for seeking
+    IDemoSeek::Record();
+
+  #if _PATCHCONFIG_FIX_STREAMPAGING
+    // Write recorded demo to disk and stop recording if it can't be written
+    if (!IDemoBlocks::Update()) {
+      _pNetwork->StopDemoRec();
+    }
+  #endif
+  }
+
 #if _PATCHCONFIG_NEW_QUERY
   // Keep using old query manager
-  if (ms_bVanillaQuery) return;
+  if (ms_bVanillaQuery) {
+    IMasterHeartbeat::Suspend();
+    return;
+  }
 
   // Update server for the master server
   static CSymbolPtr symptr("ser_bEnumeration");
+  const BOOL bServing = (GetComm().IsNetworkEnabled() && symptr.GetIndex());
 
-  if (GetComm().IsNetworkEnabled() && symptr.GetIndex()) {
-    if (ms_bDebugOutput) {
-      //CPutString("CSessionState::FlushProcessedPredictions() -> IMasterServer::OnServerUpdate()\n");
-    }
-    IMasterServer::OnServerUpdate();
+  if (bServing && ms_bDebugOutput) {
+    //CPutString("CSessionState::FlushProcessedPredictions() -> IMasterServer::OnServerUpdate()\n");
   }
+
+  // [Cecil] Update it here or let the heartbeat thread do it
+  IMasterHeartbeat::Publish(bServing);
 #endif // _PATCHCONFIG_NEW_QUERY
 };
 
 // Client processes received packet from the server
 void CSessionStatePatch::P_ProcessGameStreamBlock(CNetworkMessage &nmMessage) {
+  // [Cecil] Measure block processing during timedemos
+  ITimeDemo::CBlockTimer btTimeDemo;
+
+  // [Cecil] Session state is about to change
+  IStateCache::Invalidate();
+
+  // [Cecil] Count processed blocks
+  ITrafficStats::Count(ITrafficStats::ETD_STREAM, nmMessage);
+
   // Copy the tick to process into tick used for all tasks
   _pTimer->SetCurrentTick(ses_tmLastProcessedTick);
 
@@ -475,6 +603,10 @@ void CSessionStatePatch::P_ProcessGameStreamBlock(CNetworkMessage &nmMessage) {
         }
       }
 
+    #if _PATCHCONFIG_GUID_MASKING
+      IPlayerMap::Invalidate();
+    #endif
+
       // [Cecil] Call player addition for Core
       IHooks::OnAddPlayer(plt, _pNetwork->IsPlayerLocal(penNewPlayer));
     } break;
@@ -504,6 +636,10 @@ void CSessionStatePatch::P_ProcessGameStreamBlock(CNetworkMessage &nmMessage) {
       // Deactivate the player
       plt.Deactivate();
 
+    #if _PATCHCONFIG_GUID_MASKING
+      IPlayerMap::Invalidate();
+    #endif
+
       // Handle sent entity events
       ses_bAllowRandom = TRUE;
       CEntity::HandleSentEvents();
@@ -630,6 +766,36 @@ void CSessionStatePatch::P_Start_AtClient(INDEX ctLocalPlayers) {
   pstrPwd2.GetString() = strOldPwd2;
 };
 
+// Get current time in seconds for waiting
+static inline DOUBLE WaitTime(void) {
+  return _pTimer->GetHighPrecisionTimer().GetSeconds();
+};
+
+// Wait until some data arrives on the client socket or some time passes
+static void WaitForServerData(DOUBLE dMaxWait) {
+  const DWORD dwWait = DWORD(ClampDn(dMaxWait, 0.0) * 1000.0);
+  const SOCKET hSocket = (SOCKET)GetComm().cci_hSocket;
+
+  // No socket to wait on (e.g. local client)
+  if (hSocket == INVALID_SOCKET) {
+    Sleep(dwWait);
+    return;
+  }
+
+  fd_set fdsRead;
+  FD_ZERO(&fdsRead);
+  FD_SET(hSocket, &fdsRead);
+
+  timeval tvWait;
+  tvWait.tv_sec = dwWait / 1000;
+  tvWait.tv_usec = (dwWait % 1000) * 1000;
+
+  // Don't spin if the socket can't be waited on
+  if (select(0, &fdsRead, NULL, NULL, &tvWait) == SOCKET_ERROR) {
+    Sleep(dwWait);
+  }
+};
+
 // Wait for a stream from a server
 void CSessionStatePatch::P_WaitStream(CTMemoryStream &strmMessage, const CTString &strName, INDEX iMsgCode) {
   // Start waiting for server's response
@@ -642,10 +808,27 @@ void CSessionStatePatch::P_WaitStream(CTMemoryStream &strmMessage, const CTStrin
   // it isn't used for any checks; it's some kind of leftover from 1.07 netcode changes (it doesn't exist in 1.05)
   static CSymbolPtr pfTimeout("net_tmConnectionTimeout");
 
+  // [Cecil] Wake up as soon as data arrives instead of sleeping for a fixed time
+  const DOUBLE dProgressRate = NET_WAITMESSAGE_DELAY / 1000.0;
+  DOUBLE dLastReceived = WaitTime();
+  DOUBLE dLastProgress = -dProgressRate;
+  DOUBLE dNextWait = 0.0;
+
   // Repeat until timed out
-  for (TIME tmWait = 0; tmWait < pfTimeout.GetFloat() * 1000;
-    Sleep(NET_WAITMESSAGE_DELAY), tmWait += NET_WAITMESSAGE_DELAY)
+  for (;; WaitForServerData(dNextWait))
   {
+    const DOUBLE dTimeout = pfTimeout.GetFloat();
+    const DOUBLE dNow = WaitTime();
+    const DOUBLE dWaited = dNow - dLastReceived;
+
+    if (dWaited >= dTimeout) break;
+
+    // Update network connections and progress at least at a fixed rate
+    dNextWait = Min(dTimeout - dWaited, dProgressRate);
+
+    const BOOL bUpdateProgress = (dNow - dLastProgress >= dProgressRate);
+    if (bUpdateProgress) dLastProgress = dNow;
+
     // Update network connection sockets
     #if SE1_VER >= SE1_107
       if (!GetComm().Client_Update()) break;
@@ -660,7 +843,9 @@ void CSessionStatePatch::P_WaitStream(CTMemoryStream &strmMessage, const CTStrin
     // If nothing received yet
     if (slExpectedSize == 0) {
       // Progress with waiting
-      CallProgressHook_t(tmWait / (pfTimeout.GetFloat() * 1000));
+      if (bUpdateProgress) {
+        CallProgressHook_t(FLOAT(dWaited / dTimeout));
+      }
 
     // If something is received
     } else {
@@ -669,12 +854,14 @@ void CSessionStatePatch::P_WaitStream(CTMemoryStream &strmMessage, const CTStrin
         slReceivedLast = slReceivedSize;
 
         // Reset timeout
-        tmWait = 0;
+        dLastReceived = dNow;
       }
 
       // Progress with receiving
-      SetProgressDescription(LOCALIZE("receiving ") + strName + "  ");
-      CallProgressHook_t((FLOAT)slReceivedSize / (FLOAT)slExpectedSize);
+      if (bUpdateProgress) {
+        SetProgressDescription(LOCALIZE("receiving ") + strName + "  ");
+        CallProgressHook_t((FLOAT)slReceivedSize / (FLOAT)slExpectedSize);
+      }
     }
 
     // Continue waiting if not everything received yet
@@ -784,6 +971,12 @@ void CSessionStatePatch::P_Stop(void) {
 
   ses_apltPlayers.Clear();
   ses_apltPlayers.New(ICore::MAX_GAME_PLAYERS);
+
+  IStateCache::Invalidate();
+
+#if _PATCHCONFIG_GUID_MASKING
+  IPlayerMap::Invalidate();
+#endif
 };
 
 // Read session state
@@ -791,6 +984,12 @@ void CSessionStatePatch::P_Read(CTStream *pstr) {
   // Proceed to the original function
   (this->*pReadSessionState)(pstr);
 
+  IStateCache::Invalidate();
+
+#if _PATCHCONFIG_GUID_MASKING
+  IPlayerMap::Invalidate();
+#endif
+
   // Read server info, if needed
   if (_bSerializeServerInfo) {
     IProcessPacket::ReadServerInfoFromSessionState(*pstr);
@@ -801,6 +1000,18 @@ void CSessionStatePatch::P_Read(CTStream *pstr) {
 
 // Write session state
 void CSessionStatePatch::P_Write(CTStream *pstr) {
+  // [Cecil] Serialize it once for all clients that are joining during the same tick
+  if (!_bSerializeServerInfo && IStateCache::IsShareable()) {
+    if (!IStateCache::Reuse(*this, *pstr)) {
+      CTMemoryStream strmState;
+      (this->*pWriteSessionState)(&strmState);
+
+      IStateCache::Store(*this, strmState);
+      IStateCache::Reuse(*this, *pstr);
+    }
+    return;
+  }
+
   // Proceed to the original function
   (this->*pWriteSessionState)(pstr);
 
@@ -833,6 +1044,9 @@ void CSessionStatePatch::P_MakeSynchronisationCheck(void) {
     CServer &srv = _pNetwork->ga_srvServer;
 
     // Make local checksum for each session separately
+    static CStaticArray<ULONG> aulSessionCRCs;
+    ISyncCheck::ForSessions(*this, aulSessionCRCs);
+
     for (INDEX iSession = 0; iSession < srv.srv_assoSessions.Count(); iSession++) {
       CSessionSocket &sso = srv.srv_assoSessions[iSession];
 
@@ -840,17 +1054,11 @@ void CSessionStatePatch::P_MakeSynchronisationCheck(void) {
         continue;
       }
 
-      IProcessPacket::_iHandlingClient = iSession;
-
-      CRC_Start(ulLocalCRC);
-      ChecksumForSync(ulLocalCRC, ses_iExtensiveSyncCheck);
-      CRC_Finish(ulLocalCRC);
-
       // Create sync check
       CSyncCheck sc;
       sc.sc_tmTick = ses_tmLastSyncCheck;
       sc.sc_iSequence = ses_iLastProcessedSequence; 
-      sc.sc_ulCRC = ulLocalCRC;
+      sc.sc_ulCRC = aulSessionCRCs[iSession];
       sc.sc_iLevel = ses_iLevel;
 
       // Add this sync check to this client
@@ -888,19 +1096,6 @@ void CSessionStatePatch::P_MakeSynchronisationCheck(void) {
   _pNetwork->SendToServer(nmSyncCheck);
 };
 
-// Get player buffer from the server associated with a player entity in the world
-static CPlayerBuffer *PlayerBufferFromEntity(CPlayerEntity *pen) {
-  CStaticArray<CPlayerTarget> &aPlayerTargets = _pNetwork->ga_sesSessionState.ses_apltPlayers;
-
-  for (INDEX i = 0; i < aPlayerTargets.Count(); i++) {
-    if (aPlayerTargets[i].plt_penPlayerEntity == pen) {
-      return &_pNetwork->ga_srvServer.srv_aplbPlayers[i];
-    }
-  }
-
-  return NULL;
-};
-
 void CPlayerEntityPatch::P_Write(CTStream *ostr) {
   CMovableModelEntity::Write_t(ostr);
   const INDEX iClient = IProcessPacket::_iHandlingClient;
@@ -912,7 +1107,7 @@ void CPlayerEntityPatch::P_Write(CTStream *ostr) {
   }
 
   // Get player buffer for this entity
-  CPlayerBuffer *pplb = PlayerBufferFromEntity(this);
+  CPlayerBuffer *pplb = IPlayerMap::BufferFromEntity(this);
 
   // Start with invalid GUID
   UBYTE aubGUID[16];
@@ -932,7 +1127,7 @@ void CPlayerEntityPatch::P_Write(CTStream *ostr) {
 
     // Otherwise mask it
     } else {
-      IProcessPacket::MaskGUID(aubGUID, *pplb);
+      IPlayerMap::MaskGUID(pplb, aubGUID);
     }
   }
 
@@ -947,7 +1142,11 @@ void CPlayerEntityPatch::P_Write(CTStream *ostr) {
 
 void CPlayerEntityPatch::P_ChecksumForSync(ULONG &ulCRC, INDEX iExtensiveSyncCheck) {
   CMovableModelEntity::ChecksumForSync(ulCRC, iExtensiveSyncCheck);
-  const INDEX iClient = IProcessPacket::_iHandlingClient;
+
+  // GUID is added separately for each session
+  if (ISyncCheck::SplitAtPlayer(this, ulCRC)) return;
+
+  const INDEX iClient = ISyncCheck::HandlingClient();
 
   // Normal check for clients
   if (!IProcessPacket::ShouldMaskGUIDs() || iClient == IProcessPacket::CLT_NONE) {
@@ -957,17 +1156,10 @@ void CPlayerEntityPatch::P_ChecksumForSync(ULONG &ulCRC, INDEX iExtensiveSyncChe
   }
 
   // Get player buffer for this entity
-  CPlayerBuffer *pplb = PlayerBufferFromEntity(this);
+  CPlayerBuffer *pplb = IPlayerMap::BufferFromEntity(this);
 
   UBYTE aubGUID[16];
-
-  // Use GUID from the buffer for the current client
-  if (iClient == pplb->plb_iClient) {
-    memcpy(aubGUID, pplb->plb_pcCharacter.pc_aubGUID, sizeof(aubGUID));
-
-  } else {
-    IProcessPacket::MaskGUID(aubGUID, *pplb);
-  }
+  ISyncCheck::PlayerGUID(pplb, iClient, aubGUID);
 
   CRC_AddBlock(ulCRC, aubGUID, sizeof(aubGUID));
   CRC_AddBlock(ulCRC, en_pcCharacter.pc_aubAppearance, sizeof(en_pcCharacter.pc_aubAppearance));
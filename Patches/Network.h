@@ -40,6 +40,9 @@ class CMessageDisPatch : public CMessageDispatcher {
     // Packet receiving method type
     typedef BOOL (CCommunicationInterface::*CReceiveFunc)(INDEX, void *, SLONG &);
 
+    // Packet sending method type
+    typedef void (CCommunicationInterface::*CSendFunc)(const void *, SLONG);
+
   public:
     // Send a reliable packet to the server
     void P_SendToServerReliable(const CNetworkMessage &nmMessage);
@@ -54,6 +57,206 @@ class CMessageDisPatch : public CMessageDispatcher {
     BOOL P_ReceiveFromClientReliable(INDEX iClient, CNetworkMessage &nmMessage);
 };
 
+// Saving games in the background
+namespace IAsyncSave {
+
+// Write saved games to disk in the background
+extern INDEX _bEnabled;
+
+// Write serialized game into a file in the background (FALSE if it should be saved normally)
+BOOL Write(const CTFileName &fnmGame, CTMemoryStream &strmGame);
+
+// Report saves that have been written
+void Update(void);
+
+// Wait until all saves are written and report them
+void Wait(void);
+
+// Finish writing saved games without reporting them and stop the thread
+void Stop(void);
+
+}; // namespace
+
+// Seek index for recorded demos
+namespace IDemoSeek {
+
+// Take full session state snapshots this often while recording demos (in seconds, 0 = disabled)
+extern FLOAT _fKeyframeInterval;
+
+// Start recording seek index for a demo
+void StartRecording(const CTFileName &fnDemo);
+
+// Take a snapshot of the session state, if it's time
+void Record(void);
+
+// Finish recording seek index
+void StopRecording(void);
+
+// Load seek index of a demo, if there is one
+void Load(const CTFileName &fnDemo);
+
+// Forget seek index of the played demo
+void Clear(void);
+
+// Jump to some time in the demo that's being played
+void Seek(void *pArgs);
+
+}; // namespace
+
+// Benchmarking with demo playback
+namespace ITimeDemo {
+
+// Demo is being played as a benchmark
+extern BOOL _bActive;
+
+// Measures processing time of one game stream block during a timedemo
+class CBlockTimer {
+  public:
+    DOUBLE bt_dStart;
+
+  public:
+    CBlockTimer();
+    ~CBlockTimer();
+};
+
+// Play a demo as fast as possible and report simulation costs
+void Run(void *pArgs);
+
+}; // namespace
+
+// Benchmarking the server with simulated clients
+namespace ILoadTest {
+
+// Method for sending reliable packets to the server (replaced during load tests)
+extern CMessageDisPatch::CSendFunc _pSendReliable;
+
+// Run a server with simulated clients through an in-memory link
+void Run(void *pArgs);
+
+}; // namespace
+
+// Session state shared between joining clients
+namespace IStateCache {
+
+// Serialize session state once per tick for all joining clients
+extern INDEX _bEnabled;
+
+// Forget serialized session state after it has changed
+void Invalidate(void);
+
+// Check if the session state that's being written for the current client is the same for every joining client
+BOOL IsShareable(void);
+
+// Write session state that has already been serialized during the same tick
+BOOL Reuse(CSessionState &ses, CTStream &strm);
+
+// Remember serialized session state
+void Store(CSessionState &ses, CTMemoryStream &strmState);
+
+}; // namespace
+
+// Network traffic per message type
+namespace ITrafficStats {
+
+// Directions of counted messages
+enum EDirection {
+  ETD_RECEIVED = 0, // Received by the server from clients
+  ETD_STREAM, // Game stream blocks processed by the client
+  ETD_SENT, // Reliable messages sent by the client
+
+  ETD_MAX,
+};
+
+// Count network messages of each type
+extern INDEX _bEnabled;
+
+// How often to roll up counted messages (in seconds)
+extern FLOAT _fRollupInterval;
+
+// Count one message
+void Count(EDirection eDir, const CNetworkMessage &nmMessage);
+
+// Roll up counted messages periodically
+void Update(void);
+
+// Print counted messages
+void Print(void);
+
+// Dump counted messages into a CSV file
+void Dump(void *pArgs);
+
+// Reset all counters
+void Reset(void);
+
+}; // namespace
+
+#if _PATCHCONFIG_NEW_QUERY
+
+// Master server updates from a background thread
+namespace IMasterHeartbeat {
+
+// Update master server on a separate thread instead of every game tick
+extern INDEX _bThreaded;
+
+// How often to update master server from the thread (in seconds)
+extern FLOAT _fInterval;
+
+// Access to the master server from any thread
+extern CTCriticalSection _csMaster;
+
+// Publish server status from the game thread and update master server if it's not threaded
+void Publish(BOOL bServing);
+
+// Stop updating master server from the thread until the next publish
+void Suspend(void);
+
+// Stop the heartbeat thread
+void Stop(void);
+
+// Start receiving heartbeats on a local port instead of a real master server
+void StartLocalMaster(void *pArgs);
+
+// Print heartbeats received by the local master server
+void PrintLocalMaster(void);
+
+// Stop the local master server
+void StopLocalMaster(void);
+
+}; // namespace
+
+#endif // _PATCHCONFIG_NEW_QUERY
+
+// Batched receiving of client packets on the server
+namespace IPacketQueue {
+
+// Kinds of received packets
+enum EKind {
+  E_RELIABLE = 0,
+  E_UNRELIABLE,
+
+  E_MAX,
+};
+
+// Receive packets from all clients at once (applied on server start)
+extern INDEX _bEnabled;
+
+// Check if packets are being received in batches by the current server
+BOOL IsActive(void);
+
+// Retrieve the next packet of some client
+BOOL Receive(INDEX iClient, EKind eKind, CNetworkMessage &nmMessage);
+
+// Get method for receiving packets of some kind, with or without the queue
+CMessageDisPatch::CReceiveFunc ReceiveFunc(EKind eKind);
+
+// Receive packets of some kind through another method (NULL = through the communication interface)
+void OverrideReceiveFunc(EKind eKind, CMessageDisPatch::CReceiveFunc pFunc);
+
+// Forget all received packets
+void Clear(void);
+
+}; // namespace
+
 class CNetworkPatch : public CNetworkLibrary {
   public:
     // Pointer type to CNetworkLibrary::StartPeerToPeer_t()
@@ -132,6 +335,49 @@ class CPlayerEntityPatch : public CPlayerEntity {
     void P_ChecksumForSync(ULONG &ulCRC, INDEX iExtensiveSyncCheck);
 };
 
+// Direct mapping of player entities to player buffers
+namespace IPlayerMap {
+
+// Mark map as outdated after players have been added or removed
+void Invalidate(void);
+
+// Rebuild map and mask GUIDs of all players before using them from multiple threads
+void Prepare(void);
+
+// Get player buffer from the server associated with a player entity in the world
+CPlayerBuffer *BufferFromEntity(CPlayerEntity *pen);
+
+// Get masked GUID of a player
+void MaskGUID(CPlayerBuffer *pplb, UBYTE *aubGUID);
+
+}; // namespace
+
+// Synchronization checks with masked GUIDs
+namespace ISyncCheck {
+
+// Checksum the world once and combine it with player GUIDs for each session
+extern INDEX _bCombine;
+
+// Threads for checksumming the world for each session separately (0 = checksum on the main thread)
+extern INDEX _iThreads;
+
+// Get client that's currently being handled on this thread
+INDEX HandlingClient(void);
+
+// Get player GUID that should be seen by some client
+void PlayerGUID(CPlayerBuffer *pplb, INDEX iClient, UBYTE *aubGUID);
+
+// End world checksum segment before player GUID, if splitting
+BOOL SplitAtPlayer(CPlayerEntity *pen, ULONG &ulCRC);
+
+// Make world checksums for each active session on the server
+void ForSessions(CSessionState &ses, CStaticArray<ULONG> &aulCRCs);
+
+// Stop worker threads
+void Stop(void);
+
+}; // namespace
+
 #endif // _PATCHCONFIG_GUID_MASKING
 
 #endif // _PATCHCONFIG_EXTEND_NETWORK
@@ -0,0 +1,288 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Receive packets from all clients at once (applied on server start)
+INDEX IPacketQueue::_bEnabled = TRUE;
+static BOOL _bActive = FALSE;
+
+// Received packet in a ring buffer
+struct PacketSlot {
+  SLONG slOffset; // Where the packet starts in the ring
+  SLONG slSize; // Packet size
+};
+
+// Packets of one kind that have been received from a client
+struct ClientQueue {
+  UBYTE *pubRing; // Ring buffer that packets are received into
+  SLONG slRingSize;
+  SLONG slHead; // Where the next packet will be received
+  CStaticStackArray<PacketSlot> aSlots; // Received packets in order
+  INDEX iNextPacket; // Next packet to handle (previous ones have been handed out)
+  INDEX iDrainedPass; // Last pass in which packets of this client have been received
+  INDEX iExhaustedPass; // Last pass in which the engine has been told that this client has no more packets
+
+  ClientQueue() : pubRing(NULL), slRingSize(0), slHead(0), iNextPacket(0), iDrainedPass(-1), iExhaustedPass(-1) {};
+
+  ~ClientQueue() {
+    if (pubRing != NULL) free(pubRing);
+  };
+
+  // Forget all packets but keep allocated memory
+  void Reset(void) {
+    aSlots.PopAll();
+    iNextPacket = 0;
+    slHead = 0;
+  };
+
+  // Release packets that have already been handled
+  void ReleaseHandled(void) {
+    if (iNextPacket >= aSlots.Count()) {
+      Reset();
+    }
+  };
+
+  // Find space for receiving a packet of some size (returns -1 if the ring is full)
+  SLONG ReserveSpace(SLONG slMaxSize) {
+    // Allocate ring for a few of the biggest packets
+    if (pubRing == NULL) {
+      slRingSize = Max(SLONG(64 * 1024), slMaxSize * 8);
+      pubRing = (UBYTE *)malloc(slRingSize);
+    }
+
+    // Everything is free
+    if (iNextPacket >= aSlots.Count()) {
+      Reset();
+      return (slMaxSize <= slRingSize) ? 0 : -1;
+    }
+
+    // Start of the oldest packet that hasn't been handed out
+    const SLONG slTail = aSlots[0].slOffset;
+
+    if (slHead > slTail) {
+      // Space until the end of the ring
+      if (slRingSize - slHead >= slMaxSize) return slHead;
+
+      // Wrap around to the beginning
+      if (slTail > slMaxSize) return 0;
+
+    // Space until the oldest packet
+    } else if (slTail - slHead > slMaxSize) {
+      return slHead;
+    }
+
+    return -1;
+  };
+};
+
+// Queues of each packet kind per client
+static CStaticArray<ClientQueue> _aQueues[IPacketQueue::E_MAX];
+
+// Current pass through all clients for each packet kind
+static INDEX _aiPass[IPacketQueue::E_MAX] = { 0, 0 };
+
+// Last client that has been requested for each packet kind
+static INDEX _aiLastClient[IPacketQueue::E_MAX] = { 0x7FFFFFFF, 0x7FFFFFFF };
+
+// Message that's currently wrapping a queued packet for each packet kind
+static CNetworkMessage *_apnmWrapping[IPacketQueue::E_MAX] = { NULL, NULL };
+
+// Own buffer of the message that's wrapping a queued packet
+static UBYTE *_apubOwnBuffer[IPacketQueue::E_MAX] = { NULL, NULL };
+
+// Give the message its own buffer back once the engine has handled the queued packet
+// Engine requests packets in a loop until there are none left, so it never destroys a message that's wrapping one
+static void Unwrap(IPacketQueue::EKind eKind) {
+  CNetworkMessage *pnm = _apnmWrapping[eKind];
+  if (pnm == NULL) return;
+
+  pnm->nm_pubMessage = _apubOwnBuffer[eKind];
+  pnm->nm_pubPointer = pnm->nm_pubMessage;
+  pnm->nm_slSize = 0;
+  pnm->nm_iBit = 0;
+
+  _apnmWrapping[eKind] = NULL;
+  _apubOwnBuffer[eKind] = NULL;
+};
+
+// Methods of the communication interface for receiving each packet kind
+static const CMessageDisPatch::CReceiveFunc _apCommFuncs[IPacketQueue::E_MAX] = {
+  &CCommunicationInterface::Server_Receive_Reliable,
+  &CCommunicationInterface::Server_Receive_Unreliable,
+};
+
+// Current receiving methods for each packet kind
+static CMessageDisPatch::CReceiveFunc _apReceiveFuncs[IPacketQueue::E_MAX] = {
+  &CCommunicationInterface::Server_Receive_Reliable,
+  &CCommunicationInterface::Server_Receive_Unreliable,
+};
+
+// Receive every pending packet of some client into its queue
+static void DrainClient(INDEX iClient, IPacketQueue::EKind eKind, SLONG slMaxSize) {
+  ClientQueue &cq = _aQueues[eKind][iClient];
+  cq.iDrainedPass = _aiPass[eKind];
+
+  // Forget packets that have already been handled
+  if (cq.iNextPacket > 0) {
+    const INDEX ctLeft = cq.aSlots.Count() - cq.iNextPacket;
+
+    for (INDEX iSlot = 0; iSlot < ctLeft; iSlot++) {
+      cq.aSlots[iSlot] = cq.aSlots[cq.iNextPacket + iSlot];
+    }
+
+    cq.aSlots.PopUntil(ctLeft - 1);
+    cq.iNextPacket = 0;
+  }
+
+  CMessageDisPatch::CReceiveFunc pFunc = _apReceiveFuncs[eKind];
+
+  FOREVER {
+    // The rest will be received during the next pass
+    const SLONG slOffset = cq.ReserveSpace(slMaxSize);
+    if (slOffset == -1) break;
+
+    // Receive directly into the ring
+    SLONG slSize = slMaxSize;
+    if (!(GetComm().*pFunc)(iClient, cq.pubRing + slOffset, slSize)) break;
+
+    PacketSlot &slot = cq.aSlots.Push();
+    slot.slOffset = slOffset;
+    slot.slSize = slSize;
+
+    cq.slHead = slOffset + slSize;
+  }
+};
+
+// Start a new pass through all clients
+static void StartPass(IPacketQueue::EKind eKind, SLONG slMaxSize) {
+  _aiPass[eKind]++;
+
+  CStaticArray<ClientQueue> &aQueues = _aQueues[eKind];
+  CStaticArray<CSessionSocket> &aSessions = _pNetwork->ga_srvServer.srv_assoSessions;
+
+  for (INDEX iClient = 0; iClient < aQueues.Count(); iClient++) {
+    ClientQueue &cq = aQueues[iClient];
+
+    // Client has disconnected, so its packets shouldn't go to the next one in this session
+    // Packets of active clients are kept even if they haven't been requested for some time
+    if (iClient > 0 && !aSessions[iClient].sso_bActive) {
+      cq.Reset();
+      continue;
+    }
+
+    DrainClient(iClient, eKind, slMaxSize);
+  }
+};
+
+// Retrieve the next packet of some client
+BOOL IPacketQueue::Receive(INDEX iClient, EKind eKind, CNetworkMessage &nmMessage) {
+  // Previous packet has been handled, so its space in the ring may be reused now
+  ASSERT(_apnmWrapping[eKind] == NULL || _apnmWrapping[eKind] == &nmMessage);
+  Unwrap(eKind);
+
+  CStaticArray<ClientQueue> &aQueues = _aQueues[eKind];
+
+  // Make space for all clients
+  const INDEX ctClients = _pNetwork->ga_srvServer.srv_assoSessions.Count();
+
+  if (aQueues.Count() != ctClients) {
+    aQueues.Clear();
+    aQueues.New(ctClients);
+  }
+
+  ClientQueue &cq = aQueues[iClient];
+
+  // Engine goes through clients in order and asks each one repeatedly until it runs out of packets,
+  // so it's a new pass when it starts over or asks a client that has already run out during this pass
+  if (iClient < _aiLastClient[eKind] || cq.iExhaustedPass == _aiPass[eKind]) {
+    StartPass(eKind, nmMessage.nm_slMaxSize);
+  }
+
+  _aiLastClient[eKind] = iClient;
+
+  // Client hasn't been handled before
+  if (cq.iDrainedPass != _aiPass[eKind]) {
+    DrainClient(iClient, eKind, nmMessage.nm_slMaxSize);
+  }
+
+  // No more packets
+  if (cq.iNextPacket >= cq.aSlots.Count()) {
+    cq.iExhaustedPass = _aiPass[eKind];
+    cq.ReleaseHandled();
+    return FALSE;
+  }
+
+  const PacketSlot &slot = cq.aSlots[cq.iNextPacket++];
+
+  // Let the message read the packet straight from the ring until the next request
+  ASSERT(slot.slSize <= nmMessage.nm_slMaxSize);
+  _apnmWrapping[eKind] = &nmMessage;
+  _apubOwnBuffer[eKind] = nmMessage.nm_pubMessage;
+
+  nmMessage.nm_pubMessage = cq.pubRing + slot.slOffset;
+  nmMessage.nm_slSize = slot.slSize;
+
+  // Init the message structure
+  nmMessage.nm_pubPointer = nmMessage.nm_pubMessage;
+  nmMessage.nm_iBit = 0;
+
+  UBYTE ubType;
+  nmMessage.Read(&ubType, sizeof(ubType));
+  nmMessage.nm_mtType = (MESSAGETYPE)ubType;
+
+  return TRUE;
+};
+
+// Get method for receiving packets of some kind, with or without the queue
+CMessageDisPatch::CReceiveFunc IPacketQueue::ReceiveFunc(EKind eKind) {
+  return _apReceiveFuncs[eKind];
+};
+
+// Receive packets of some kind through another method (NULL = through the communication interface)
+void IPacketQueue::OverrideReceiveFunc(EKind eKind, CMessageDisPatch::CReceiveFunc pFunc) {
+  _apReceiveFuncs[eKind] = (pFunc != NULL) ? pFunc : _apCommFuncs[eKind];
+};
+
+// Check if packets are being received in batches by the current server
+BOOL IPacketQueue::IsActive(void) {
+  return _bActive;
+};
+
+// Forget all received packets
+void IPacketQueue::Clear(void) {
+  // Switching it in the middle of a game would lose queued packets
+  _bActive = _bEnabled;
+
+  for (INDEX iKind = 0; iKind < E_MAX; iKind++) {
+    ASSERT(_apnmWrapping[iKind] == NULL);
+    _apnmWrapping[iKind] = NULL;
+    _apubOwnBuffer[iKind] = NULL;
+
+    _aQueues[iKind].Clear();
+    _aiPass[iKind] = 0;
+    _aiLastClient[iKind] = 0x7FFFFFFF;
+  }
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,183 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK && _PATCHCONFIG_GUID_MASKING
+
+// Player entity associated with a player index
+struct PlayerMapSlot {
+  CPlayerEntity *pen;
+  INDEX iPlayer;
+};
+
+// Masked GUID of a player
+struct MaskedGUID {
+  BOOL bValid;
+  INDEX iClient; // Client of the player at the time of masking
+  UBYTE aubSource[16]; // Original GUID
+  UBYTE aubMasked[16];
+};
+
+// Hash table of player entities (size is a power of two)
+static CStaticArray<PlayerMapSlot> _aSlots;
+
+// Masked GUIDs for each player buffer
+static CStaticArray<MaskedGUID> _aMaskedGUIDs;
+
+// Map needs to be rebuilt
+static BOOL _bOutdated = TRUE;
+
+// Get starting slot for some entity
+static inline INDEX SlotIndex(CPlayerEntity *pen) {
+  // Entities are allocated with some alignment, so mix the rest of the bits
+  const ULONG ulHash = ULONG(size_t(pen) >> 4) * 2654435761UL;
+  return INDEX(ulHash >> 8) & (_aSlots.Count() - 1);
+};
+
+// Map all player entities to their player indices
+static void RebuildMap(void) {
+  CStaticArray<CPlayerTarget> &aPlayerTargets = _pNetwork->ga_sesSessionState.ses_apltPlayers;
+  const INDEX ctPlayers = aPlayerTargets.Count();
+
+  // Keep the table mostly empty for short probing
+  INDEX ctSlots = 16;
+  while (ctSlots < ctPlayers * 4) ctSlots <<= 1;
+
+  if (_aSlots.Count() != ctSlots) {
+    _aSlots.Clear();
+    _aSlots.New(ctSlots);
+  }
+
+  for (INDEX iSlot = 0; iSlot < ctSlots; iSlot++) {
+    _aSlots[iSlot].pen = NULL;
+  }
+
+  for (INDEX iPlayer = 0; iPlayer < ctPlayers; iPlayer++) {
+    CPlayerEntity *pen = aPlayerTargets[iPlayer].plt_penPlayerEntity;
+    if (pen == NULL) continue;
+
+    INDEX iSlot = SlotIndex(pen);
+
+    while (_aSlots[iSlot].pen != NULL) {
+      // Same entity in multiple targets resolves to the first one, like a linear scan
+      if (_aSlots[iSlot].pen == pen) break;
+      iSlot = (iSlot + 1) & (ctSlots - 1);
+    }
+
+    if (_aSlots[iSlot].pen == pen) continue;
+
+    _aSlots[iSlot].pen = pen;
+    _aSlots[iSlot].iPlayer = iPlayer;
+  }
+
+  // Forget masked GUIDs
+  const INDEX ctBuffers = _pNetwork->ga_srvServer.srv_aplbPlayers.Count();
+
+  if (_aMaskedGUIDs.Count() != ctBuffers) {
+    _aMaskedGUIDs.Clear();
+    _aMaskedGUIDs.New(ctBuffers);
+  }
+
+  for (INDEX iBuffer = 0; iBuffer < ctBuffers; iBuffer++) {
+    _aMaskedGUIDs[iBuffer].bValid = FALSE;
+  }
+
+  _bOutdated = FALSE;
+};
+
+// Mark map as outdated after players have been added or removed
+void IPlayerMap::Invalidate(void) {
+  _bOutdated = TRUE;
+};
+
+// Rebuild map and mask GUIDs of all players before using them from multiple threads
+void IPlayerMap::Prepare(void) {
+  if (_bOutdated) RebuildMap();
+
+  CStaticArray<CPlayerBuffer> &aBuffers = _pNetwork->ga_srvServer.srv_aplbPlayers;
+  UBYTE aubGUID[16];
+
+  for (INDEX iBuffer = 0; iBuffer < aBuffers.Count(); iBuffer++) {
+    if (!aBuffers[iBuffer].plb_Active) continue;
+
+    MaskGUID(&aBuffers[iBuffer], aubGUID);
+  }
+};
+
+// Get player buffer from the server associated with a player entity in the world
+CPlayerBuffer *IPlayerMap::BufferFromEntity(CPlayerEntity *pen) {
+  if (_bOutdated) RebuildMap();
+
+  CStaticArray<CPlayerTarget> &aPlayerTargets = _pNetwork->ga_sesSessionState.ses_apltPlayers;
+  const INDEX ctSlots = _aSlots.Count();
+
+  INDEX iSlot = SlotIndex(pen);
+
+  for (INDEX iProbe = 0; iProbe < ctSlots; iProbe++) {
+    const PlayerMapSlot &slot = _aSlots[iSlot];
+    if (slot.pen == NULL) break;
+
+    // Make sure that the player hasn't been reattached since the last rebuild
+    if (slot.pen == pen && aPlayerTargets[slot.iPlayer].plt_penPlayerEntity == pen) {
+      return &_pNetwork->ga_srvServer.srv_aplbPlayers[slot.iPlayer];
+    }
+
+    iSlot = (iSlot + 1) & (ctSlots - 1);
+  }
+
+  // Not mapped, which is rare, so make sure with a full search
+  // [Cecil] NOTE: Don't mark the map as outdated here because it may be used by multiple threads
+  for (INDEX i = 0; i < aPlayerTargets.Count(); i++) {
+    if (aPlayerTargets[i].plt_penPlayerEntity == pen) {
+      return &_pNetwork->ga_srvServer.srv_aplbPlayers[i];
+    }
+  }
+
+  return NULL;
+};
+
+// Get masked GUID of a player
+void IPlayerMap::MaskGUID(CPlayerBuffer *pplb, UBYTE *aubGUID) {
+  const INDEX iBuffer = pplb->plb_Index;
+
+  // Not a buffer from the server
+  if (iBuffer < 0 || iBuffer >= _aMaskedGUIDs.Count()) {
+    IProcessPacket::MaskGUID(aubGUID, *pplb);
+    return;
+  }
+
+  MaskedGUID &mg = _aMaskedGUIDs[iBuffer];
+  const UBYTE *aubSource = pplb->plb_pcCharacter.pc_aubGUID;
+
+  // Mask it again if the player has been changed
+  if (!mg.bValid || mg.iClient != pplb->plb_iClient || memcmp(mg.aubSource, aubSource, sizeof(mg.aubSource)) != 0) {
+    IProcessPacket::MaskGUID(mg.aubMasked, *pplb);
+
+    memcpy(mg.aubSource, aubSource, sizeof(mg.aubSource));
+    mg.iClient = pplb->plb_iClient;
+    mg.bValid = TRUE;
+  }
+
+  memcpy(aubGUID, mg.aubMasked, sizeof(mg.aubMasked));
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK && _PATCHCONFIG_GUID_MASKING
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,138 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "FileSystem.h"
+#include "UnpageStreams.h"
+#include "../WorkerPool.h"
+
+#if _PATCHCONFIG_EXTEND_FILESYSTEM
+
+// Resource that needs to be warmed up
+struct PrefetchResource {
+  CTFileName fnmFile; // Full path to the file or a ZIP entry
+  INDEX iType; // Where the file is located
+};
+
+// Threads for warming up resources
+static CWorkerPool _wpPrefetch;
+
+// Read the whole file to let the system cache it
+static void ReadAhead(const CTFileName &fnmFile) {
+  HANDLE hFile = CreateFileA(fnmFile.str_String, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+    NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+  if (hFile == INVALID_HANDLE_VALUE) return;
+
+  const DWORD dwChunk = 64 * 1024;
+  UBYTE *pubChunk = (UBYTE *)malloc(dwChunk);
+  DWORD dwRead = 0;
+
+  while (ReadFile(hFile, pubChunk, dwChunk, &dwRead, NULL) && dwRead != 0) {
+    NOTHING;
+  }
+
+  free(pubChunk);
+  CloseHandle(hFile);
+};
+
+// Warm up one resource
+static void WarmUpResource(void *pData) {
+  PrefetchResource *pres = (PrefetchResource *)pData;
+
+  if (pres->iType == EFP_FILE) {
+    ReadAhead(pres->fnmFile);
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  } else {
+    // Decompress into the entry cache; it's fine if it fails because it will be reported upon loading
+    try {
+      IZipCache::Prefetch(pres->fnmFile, pres->iType);
+
+    } catch (char *strError) {
+      (void)strError;
+    }
+#endif
+  }
+
+  delete pres;
+};
+
+// Discard resource that hasn't been warmed up
+static void DiscardResource(void *pData) {
+  delete (PrefetchResource *)pData;
+};
+
+// Resolve new dictionary filenames and start warming them up
+void IPrefetch::Dictionary(CDynamicStackArray<CTFileName> &afnmDictionary, INDEX iFirst, INDEX ct) {
+  const INDEX ctThreads = Clamp(_EnginePatches._iPrefetchThreads, (INDEX)0, (INDEX)8);
+
+  // Prefetching is disabled
+  if (ctThreads == 0) return;
+
+  if (!_wpPrefetch.IsStarted()) {
+    _wpPrefetch.Start(ctThreads, THREAD_PRIORITY_BELOW_NORMAL);
+  }
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  // Loose files to read in one batch
+  CStaticStackArray<CTFileName> aLooseFiles;
+#endif
+
+  for (INDEX i = iFirst; i < iFirst + ct; i++) {
+    // Resolve the file on this thread in the same way it will be opened later
+    CTFileName fnmExpanded;
+    const INDEX iType = ExpandFilePath(EFP_READ, afnmDictionary[i], fnmExpanded);
+
+    // Missing files will be reported upon loading
+    if (iType == EFP_NONE) continue;
+
+  #if _PATCHCONFIG_FIX_STREAMPAGING
+    // Read loose files directly into memory
+    if (iType == EFP_FILE) {
+      aLooseFiles.Push() = fnmExpanded;
+      continue;
+    }
+
+  #else
+    // Nowhere to keep decompressed entries
+    if (iType != EFP_FILE) continue;
+  #endif
+
+    PrefetchResource *pres = new PrefetchResource;
+    pres->fnmFile = fnmExpanded;
+    pres->iType = iType;
+
+    _wpPrefetch.AddJob(&WarmUpResource, pres, &DiscardResource);
+  }
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  if (aLooseFiles.Count() != 0) {
+    IFileReads::Submit(&aLooseFiles[0], aLooseFiles.Count());
+  }
+#endif
+};
+
+// Drop queued resources and stop all workers
+void IPrefetch::Stop(void) {
+  _wpPrefetch.Stop();
+};
+
+#endif // _PATCHCONFIG_EXTEND_FILESYSTEM
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
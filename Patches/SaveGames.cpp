@@ -0,0 +1,187 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+#include "UnpageStreams.h"
+#include "../WorkerPool.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Write saved games to disk in the background
+INDEX IAsyncSave::_bEnabled = TRUE;
+
+// Snapshot of a saved game that's being written
+struct SaveJob {
+  CTFileName fnmGame; // Game file as requested
+  CTFileName fnmFull; // Full path to the game file
+  CTString strTemp; // Temporary file that replaces the game file once it's written
+  FILE *pFile; // Opened temporary file to write into
+  UBYTE *pubData; // Serialized game
+  SLONG slSize;
+  BOOL bWritten;
+};
+
+// Thread that writes saved games
+static CWorkerPool _wpSaves;
+
+// Saves that have been written but not reported yet
+static CStaticStackArray<SaveJob *> _aFinished;
+static CTCriticalSection _csFinished;
+
+// Write snapshot to disk on a worker thread
+static void ExecuteSave(void *pData) {
+  SaveJob *pjob = (SaveJob *)pData;
+
+  const size_t iWritten = fwrite(pjob->pubData, 1, pjob->slSize, pjob->pFile);
+  pjob->bWritten = (iWritten == size_t(pjob->slSize));
+  pjob->bWritten &= (fclose(pjob->pFile) == 0);
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::BufferFreed(pjob->pubData);
+#endif
+
+  free(pjob->pubData);
+  pjob->pubData = NULL;
+
+  // Replace the old file only with a complete one
+  if (pjob->bWritten) {
+    pjob->bWritten = MoveFileExA(pjob->strTemp.str_String, pjob->fnmFull.str_String, MOVEFILE_REPLACE_EXISTING);
+  }
+
+  if (!pjob->bWritten) {
+    DeleteFileA(pjob->strTemp.str_String);
+  }
+
+  CTSingleLock slFinished(&_csFinished, TRUE);
+  _aFinished.Push() = pjob;
+};
+
+// Write serialized game into a file in the background (FALSE if it should be saved normally)
+BOOL IAsyncSave::Write(const CTFileName &fnmGame, CTMemoryStream &strmGame) {
+  // Previous save may still be writing into the same file
+  Wait();
+
+  const SLONG slSize = strmGame.GetStreamSize();
+  UBYTE *pubData = NULL;
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  // Take the snapshot away from the stream
+  pubData = ((CUnpageStreamPatch &)strmGame).DetachBuffer();
+#endif
+
+  // Copy the snapshot if the stream is paged by the engine
+  if (pubData == NULL) {
+    pubData = (UBYTE *)malloc(slSize);
+    if (pubData == NULL) return FALSE;
+
+    strmGame.SetPos_t(0);
+    strmGame.Read_t(pubData, slSize);
+  }
+
+  // Write into a temporary file, so the old game is kept intact if writing fails
+  CTFileName fnmFull;
+  ExpandFilePath(EFP_WRITE, fnmGame, fnmFull);
+
+  const CTString strTemp = fnmFull + ".tmp";
+
+  // Open the file right away to report errors as before
+  FILE *pFile = fopen(strTemp.str_String, "wb");
+
+  if (pFile == NULL) {
+    free(pubData);
+    ThrowF_t(LOCALIZE("Cannot create file `%s` (%s)"), strTemp.str_String, strerror(errno));
+  }
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::BufferAllocated(pubData, slSize, IStreamStats::EBO_MEMORY, fnmGame);
+#endif
+
+  SaveJob *pjob = new SaveJob;
+  pjob->fnmGame = fnmGame;
+  pjob->fnmFull = fnmFull;
+  pjob->strTemp = strTemp;
+  pjob->pFile = pFile;
+  pjob->pubData = pubData;
+  pjob->slSize = slSize;
+  pjob->bWritten = FALSE;
+
+  if (!_wpSaves.IsStarted()) {
+    _wpSaves.Start(1, THREAD_PRIORITY_BELOW_NORMAL);
+  }
+
+  _wpSaves.AddJob(&ExecuteSave, pjob);
+  return TRUE;
+};
+
+// Report saves that have been written
+void IAsyncSave::Update(void) {
+  CStaticStackArray<SaveJob *> aReport;
+
+  {
+    CTSingleLock slFinished(&_csFinished, TRUE);
+    if (_aFinished.Count() == 0) return;
+
+    for (INDEX i = 0; i < _aFinished.Count(); i++) {
+      aReport.Push() = _aFinished[i];
+    }
+
+    _aFinished.PopAll();
+  }
+
+  for (INDEX i = 0; i < aReport.Count(); i++) {
+    SaveJob *pjob = aReport[i];
+
+    if (pjob->bWritten) {
+      // [Cecil] Save game for Core
+      IHooks::OnGameSave(pjob->fnmGame);
+
+    } else {
+      // Previous file under the same name has been left as is
+      CPrintF(TRANS("Cannot write saved game `%s`\n"), pjob->fnmGame.str_String);
+    }
+
+    delete pjob;
+  }
+};
+
+// Wait until all saves are written and report them
+void IAsyncSave::Wait(void) {
+  if (!_wpSaves.IsStarted()) return;
+
+  _wpSaves.Wait();
+  Update();
+};
+
+// Finish writing saved games without reporting them and stop the thread
+void IAsyncSave::Stop(void) {
+  _wpSaves.Wait();
+  _wpSaves.Stop();
+
+  CTSingleLock slFinished(&_csFinished, TRUE);
+
+  for (INDEX i = 0; i < _aFinished.Count(); i++) {
+    delete _aFinished[i];
+  }
+
+  _aFinished.PopAll();
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,103 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Serialize session state once per tick for all joining clients
+INDEX IStateCache::_bEnabled = TRUE;
+
+// Serialized session state
+static UBYTE *_pubState = NULL;
+static SLONG _slStateSize = 0;
+
+// Tick and sequence of the serialized session state
+static TIME _tmStateTick = -1.0f;
+static INDEX _iStateSequence = -1;
+
+// Forget serialized session state after it has changed
+void IStateCache::Invalidate(void) {
+  if (_pubState == NULL) return;
+
+  free(_pubState);
+  _pubState = NULL;
+  _slStateSize = 0;
+};
+
+// Check if the session state that's being written for the current client is the same for every joining client
+BOOL IStateCache::IsShareable(void) {
+  if (!_bEnabled || !_pNetwork->IsServer()) return FALSE;
+
+  CServer &srv = _pNetwork->ga_srvServer;
+  const INDEX iClient = IProcessPacket::_iHandlingClient;
+
+  // Not sending it to some client
+  if (iClient == IProcessPacket::CLT_NONE || iClient == IProcessPacket::CLT_SAVE) return FALSE;
+  if (iClient < 0 || iClient >= srv.srv_assoSessions.Count()) return FALSE;
+
+#if _PATCHCONFIG_GUID_MASKING
+  // Client sees GUIDs of its own players unmasked
+  if (IProcessPacket::ShouldMaskGUIDs()) {
+    CStaticArray<CPlayerBuffer> &aBuffers = srv.srv_aplbPlayers;
+
+    for (INDEX i = 0; i < aBuffers.Count(); i++) {
+      if (aBuffers[i].plb_Active && aBuffers[i].plb_iClient == iClient) return FALSE;
+    }
+  }
+#endif
+
+  return TRUE;
+};
+
+// Write session state that has already been serialized during the same tick
+BOOL IStateCache::Reuse(CSessionState &ses, CTStream &strm) {
+  if (_pubState == NULL) return FALSE;
+
+  // Session state has been advanced since then
+  if (_tmStateTick != ses.ses_tmLastProcessedTick || _iStateSequence != ses.ses_iLastProcessedSequence) {
+    Invalidate();
+    return FALSE;
+  }
+
+  strm.Write_t(_pubState, _slStateSize);
+  return TRUE;
+};
+
+// Remember serialized session state
+void IStateCache::Store(CSessionState &ses, CTMemoryStream &strmState) {
+  Invalidate();
+
+  UBYTE *pubState;
+  SLONG slSize;
+  strmState.LockBuffer(&pubState, &slSize);
+
+  _pubState = (UBYTE *)malloc(slSize);
+  memcpy(_pubState, pubState, slSize);
+  _slStateSize = slSize;
+
+  strmState.UnlockBuffer();
+
+  _tmStateTick = ses.ses_tmLastProcessedTick;
+  _iStateSequence = ses.ses_iLastProcessedSequence;
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
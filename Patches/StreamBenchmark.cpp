@@ -0,0 +1,246 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "UnpageStreams.h"
+
+#include <Engine/Base/Unzip.h>
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+
+// Directory for temporary benchmark files
+static const CTString _strBenchDir = "Temp\\StreamBench\\";
+
+// Measured run of one benchmark
+class CBenchRun {
+  public:
+    const char *br_strName;
+    DOUBLE br_dStartTime;
+    IStreamStats::Stats br_ssStart;
+    INDEX br_ctOps;
+    __int64 br_llBytes;
+
+  public:
+    // Start measuring
+    CBenchRun(const char *strName) : br_strName(strName), br_ctOps(0), br_llBytes(0)
+    {
+      IStreamStats::Get(br_ssStart);
+      br_dStartTime = IStreamStats::Now();
+    };
+
+    // Count one operation
+    inline void Op(SLONG slBytes) {
+      br_ctOps++;
+      br_llBytes += slBytes;
+    };
+
+    // Stop measuring and print results
+    void Report(void) {
+      const DOUBLE dTime = ClampDn(IStreamStats::Now() - br_dStartTime, 1e-6);
+
+      IStreamStats::Stats ssEnd;
+      IStreamStats::Get(ssEnd);
+
+      const DOUBLE dMB = DOUBLE(br_llBytes) / (1024.0 * 1024.0);
+      const INDEX ctAllocs = ssEnd.ctAllocations - br_ssStart.ctAllocations;
+
+      CPrintF("  %-12s: %6d ops in %7.3fs | %10.1f ops/s | %8.2f MB/s | %d allocs\n",
+        br_strName, br_ctOps, dTime, br_ctOps / dTime, dMB / dTime, ctAllocs);
+    };
+};
+
+// Fill buffer with somewhat compressible pseudo-random data
+static void FillSyntheticData(UBYTE *pubData, SLONG slSize, ULONG ulSeed) {
+  ULONG ulRandom = ulSeed * 1103515245 + 12345;
+
+  for (SLONG i = 0; i < slSize; i++) {
+    // Repeat values in short runs like serialized structures tend to
+    if ((i & 7) == 0) {
+      ulRandom = ulRandom * 1103515245 + 12345;
+    }
+
+    pubData[i] = UBYTE(ulRandom >> ((i & 3) * 8)) & 0x3F;
+  }
+};
+
+// Get benchmark file by its index
+static CTFileName BenchFile(INDEX iFile) {
+  CTString strFile;
+  strFile.PrintF("%s%d.bin", _strBenchDir.str_String, iFile);
+  return CTFileName(strFile);
+};
+
+// Write a file with synthetic data
+static void WriteBenchFile(const CTFileName &fnm, const UBYTE *pubData, SLONG slSize) {
+  CTFileStream strm;
+  strm.Create_t(fnm);
+  strm.Write_t(pubData, slSize);
+  strm.Close();
+};
+
+// Create and close many small files
+static void BenchWriteClose(INDEX ctFiles, const UBYTE *pubData, SLONG slSize) {
+  CBenchRun br("write/close");
+
+  for (INDEX i = 0; i < ctFiles; i++) {
+    WriteBenchFile(BenchFile(i), pubData, slSize);
+    br.Op(slSize);
+  }
+
+  br.Report();
+};
+
+// Open and read many small files
+static void BenchOpenStorm(INDEX ctFiles) {
+  CBenchRun br("open storm");
+
+  for (INDEX i = 0; i < ctFiles; i++) {
+    CTFileStream strm;
+    strm.Open_t(BenchFile(i));
+    br.Op(strm.GetStreamSize());
+    strm.Close();
+  }
+
+  br.Report();
+};
+
+// Read one big file sequentially
+static void BenchSequential(INDEX ctPasses, const UBYTE *pubData, SLONG slSize) {
+  const CTFileName fnmBig = _strBenchDir + "Big.bin";
+  WriteBenchFile(fnmBig, pubData, slSize);
+
+  UBYTE aubChunk[4096];
+  CBenchRun br("sequential");
+
+  for (INDEX iPass = 0; iPass < ctPasses; iPass++) {
+    CTFileStream strm;
+    strm.Open_t(fnmBig);
+
+    SLONG slLeft = strm.GetStreamSize();
+
+    while (slLeft > 0) {
+      const SLONG slRead = Min(slLeft, (SLONG)sizeof(aubChunk));
+      strm.Read_t(aubChunk, slRead);
+      slLeft -= slRead;
+    }
+
+    br.Op(strm.GetStreamSize());
+    strm.Close();
+  }
+
+  br.Report();
+};
+
+// Read entries from loaded ZIP archives
+static void BenchZipEntries(INDEX ctEntries) {
+  const INDEX ctZip = UNZIPGetFileCount();
+
+  if (ctZip == 0) {
+    CPutString(TRANS("  zip entries : no archives loaded, skipped\n"));
+    return;
+  }
+
+  CBenchRun br("zip entries");
+
+  // Go through the same entries twice to include cache hits
+  for (INDEX i = 0; i < ctEntries; i++) {
+    const CTFileName &fnmEntry = UNZIPGetFileAtIndex(i % Min(ctZip, ctEntries / 2 + 1));
+
+    try {
+      CTFileStream strm;
+      strm.Open_t(fnmEntry);
+      br.Op(strm.GetStreamSize());
+      strm.Close();
+
+    } catch (char *strError) {
+      // Overridden by a loose file or an invalid entry
+      (void)strError;
+    }
+  }
+
+  br.Report();
+};
+
+// Remember and restore session state
+static void BenchRemLevels(INDEX ctLevels, const UBYTE *pubData, SLONG slSize) {
+  CBenchRun br("remlevels");
+
+  for (INDEX i = 0; i < ctLevels; i++) {
+    CRemLevel *prl = new CRemLevel;
+    prl->rl_strFileName.PrintF("Bench%d", i);
+
+    prl->Write_t(pubData, slSize);
+    prl->Compress();
+
+    prl->Decompress();
+    prl->SetPos_t(0);
+    br.Op(slSize);
+
+    delete prl;
+  }
+
+  br.Report();
+};
+
+// Measure throughput of patched streams with synthetic data
+void IStreamStats::Benchmark(void *pArgs) {
+  INDEX iScale = NEXTARGUMENT(INDEX);
+  iScale = Clamp(iScale, (INDEX)1, (INDEX)100);
+
+  const INDEX ctSmall = 200 * iScale;
+  const SLONG slSmall = 4 * 1024;
+  const SLONG slBig = 16 * 1024 * 1024;
+
+  UBYTE *pubData = (UBYTE *)malloc(slBig);
+  FillSyntheticData(pubData, slBig, 0x5EED);
+
+  // Make sure the directory exists
+  CTFileName fnmDir;
+  ExpandFilePath(EFP_WRITE, BenchFile(0), fnmDir);
+  CreateDirectoryA(fnmDir.FileDir().str_String, NULL);
+
+  CPrintF(TRANS("Stream benchmark (scale %d):\n"), iScale);
+
+  try {
+    BenchWriteClose(ctSmall, pubData, slSmall);
+    BenchOpenStorm(ctSmall);
+    BenchSequential(4 * iScale, pubData, slBig);
+    BenchZipEntries(ctSmall);
+    BenchRemLevels(4 * iScale, pubData, slBig);
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Stream benchmark failed:\n%s\n"), strError);
+  }
+
+  free(pubData);
+
+  // Clean up
+  for (INDEX i = 0; i < ctSmall; i++) {
+    CTFileName fnmFull;
+    ExpandFilePath(EFP_WRITE, BenchFile(i), fnmFull);
+    remove(fnmFull.str_String);
+  }
+
+  CTFileName fnmBig;
+  ExpandFilePath(EFP_WRITE, _strBenchDir + "Big.bin", fnmBig);
+  remove(fnmBig.str_String);
+};
+
+#endif // _PATCHCONFIG_FIX_STREAMPAGING
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
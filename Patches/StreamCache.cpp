@@ -0,0 +1,764 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "UnpageStreams.h"
+#include "../AsyncIO.h"
+
+#include <CoreLib/Base/Unzip.h>
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+
+// Decompressed ZIP entry
+struct ZipCacheEntry {
+  CListNode ze_lnInCache; // Node in the cache (most recently used ones first)
+  CTFileName ze_fnmFile; // Entry filename
+  INDEX ze_iType; // EFP_MODZIP or EFP_BASEZIP
+  UBYTE *ze_pubData; // Decompressed contents
+  SLONG ze_slSize; // Decompressed size
+  BOOL ze_bPrefetched; // Decompressed ahead of time and hasn't been opened yet
+  INDEX ze_ctRefs; // Streams that are reading the contents
+  BOOL ze_bDiscarded; // Removed from the cache while streams are still reading it
+
+  ZipCacheEntry() : ze_iType(EFP_NONE), ze_pubData(NULL), ze_slSize(0), ze_bPrefetched(FALSE),
+    ze_ctRefs(0), ze_bDiscarded(FALSE) {};
+
+  ~ZipCacheEntry() {
+    if (ze_pubData != NULL) free(ze_pubData);
+  };
+};
+
+// ZIP entry that's being decompressed ahead of time
+struct ZipPrefetch {
+  CTFileName zp_fnmFile; // Entry filename
+  INDEX zp_iType; // EFP_MODZIP or EFP_BASEZIP
+  HANDLE zp_hDone; // Set once the entry is cached or dropped
+  INDEX zp_ctRefs; // Prefetching job and threads that are waiting for it
+};
+
+static CListHead _lhZipCache;
+static SLONG _slZipCacheMemory = 0;
+static SLONG _slPrefetchMemory = 0; // Entries that have been decompressed ahead of time but haven't been opened yet
+static CStaticStackArray<ZipPrefetch *> _aPrefetching;
+static CStaticStackArray<ZipCacheEntry *> _aShared; // Entries that are being read by streams
+static CTCriticalSection _csZipCache;
+
+// Synchronize ZIP access between the main thread and background workers
+CTCriticalSection _csUnzip;
+
+// How much of an entry to decompress at once in the background before letting other threads access ZIP files
+static const SLONG _slPrefetchChunk = 256 * 1024;
+
+// Find cached entry by its filename
+static ZipCacheEntry *FindCachedEntry(const CTFileName &fnmFile, INDEX iType) {
+  FOREACHINLIST(ZipCacheEntry, ze_lnInCache, _lhZipCache, itze) {
+    ZipCacheEntry &ze = *itze;
+
+    if (ze.ze_iType == iType && ze.ze_fnmFile == fnmFile) {
+      return &ze;
+    }
+  }
+
+  return NULL;
+};
+
+// Find entry that's being decompressed ahead of time
+static INDEX FindPrefetch(const CTFileName &fnmFile, INDEX iType) {
+  for (INDEX i = 0; i < _aPrefetching.Count(); i++) {
+    const ZipPrefetch &zp = *_aPrefetching[i];
+
+    if (zp.zp_iType == iType && zp.zp_fnmFile == fnmFile) {
+      return i;
+    }
+  }
+
+  return -1;
+};
+
+// Release a reference to the prefetched entry (under the cache lock)
+static void ReleasePrefetch(ZipPrefetch *pzp) {
+  if (--pzp->zp_ctRefs > 0) return;
+
+  CloseHandle(pzp->zp_hDone);
+  delete pzp;
+};
+
+// Allocate buffer for decompressed contents that's padded in the same way as stream buffers
+static UBYTE *AllocEntryBuffer(SLONG slSize) {
+  return (UBYTE *)calloc((slSize / 64 + 2) * 64, 1);
+};
+
+// Free cached entry along with its contents
+static void DeleteCachedEntry(ZipCacheEntry *pze) {
+  IStreamStats::BufferFreed(pze->ze_pubData);
+  delete pze;
+};
+
+// Discard a cached entry
+static void DiscardCachedEntry(ZipCacheEntry *pze) {
+  _slZipCacheMemory -= pze->ze_slSize;
+
+  if (pze->ze_bPrefetched) {
+    _slPrefetchMemory -= pze->ze_slSize;
+  }
+
+  pze->ze_lnInCache.Remove();
+
+  // Freed once the last stream stops reading it
+  if (pze->ze_ctRefs > 0) {
+    pze->ze_bDiscarded = TRUE;
+    return;
+  }
+
+  DeleteCachedEntry(pze);
+};
+
+// Let the stream read contents of a cached entry directly (under the cache lock)
+static void ShareCachedEntry(CUnpageStreamPatch &strm, ZipCacheEntry *pze) {
+  if (pze->ze_ctRefs++ == 0) {
+    _aShared.Push() = pze;
+  }
+
+  strm.ShareBuffer(pze->ze_pubData, pze->ze_slSize);
+};
+
+// Discard least recently used entries until they fit into the budget
+static void EvictCachedEntries(SLONG slBudget) {
+  if (_slZipCacheMemory <= slBudget) return;
+
+  // Most recently used entries first
+  CStaticStackArray<ZipCacheEntry *> apEntries;
+
+  FOREACHINLIST(ZipCacheEntry, ze_lnInCache, _lhZipCache, itze) {
+    apEntries.Push() = &*itze;
+  }
+
+  // Keep prefetched entries that haven't been opened yet for as long as possible
+  for (INDEX iPass = 0; iPass < 2; iPass++) {
+    for (INDEX i = apEntries.Count() - 1; i >= 0 && _slZipCacheMemory > slBudget; i--) {
+      ZipCacheEntry *pze = apEntries[i];
+      if (pze == NULL || (iPass == 0 && pze->ze_bPrefetched)) continue;
+
+      DiscardCachedEntry(pze);
+      apEntries[i] = NULL;
+    }
+  }
+};
+
+// Open stream from a cached entry, if there is one
+BOOL IZipCache::Open(CUnpageStreamPatch &strm, const CTFileName &fnmFile, INDEX iType) {
+  // Caching is disabled
+  if (_EnginePatches._iZipCacheSize <= 0) return FALSE;
+
+  CTSingleLock slCache(&_csZipCache, TRUE);
+
+  // Wait until it's decompressed in the background instead of doing it again
+  const INDEX iPrefetch = FindPrefetch(fnmFile, iType);
+
+  if (iPrefetch != -1) {
+    ZipPrefetch *pzp = _aPrefetching[iPrefetch];
+    pzp->zp_ctRefs++;
+
+    slCache.Unlock();
+    WaitForSingleObject(pzp->zp_hDone, INFINITE);
+    slCache.Lock();
+
+    ReleasePrefetch(pzp);
+  }
+
+  ZipCacheEntry *pze = FindCachedEntry(fnmFile, iType);
+
+  if (pze == NULL) return FALSE;
+
+  // Mark as the most recently used entry
+  pze->ze_lnInCache.Remove();
+  _lhZipCache.AddHead(pze->ze_lnInCache);
+
+  if (pze->ze_bPrefetched) {
+    pze->ze_bPrefetched = FALSE;
+    _slPrefetchMemory -= pze->ze_slSize;
+  }
+
+  // Read decompressed contents without copying them
+  ShareCachedEntry(strm, pze);
+  return TRUE;
+};
+
+// Check if an entry of some size can be cached
+static inline BOOL FitsIntoCache(SLONG slSize) {
+  // Don't let a single entry take over the whole cache
+  return slSize > 0 && slSize <= _EnginePatches._iZipCacheSize * 1024 / 4;
+};
+
+// Add decompressed contents to the cache and take ownership of them (under the cache lock)
+static ZipCacheEntry *AddCachedEntry(const CTFileName &fnmFile, INDEX iType, UBYTE *pubData, SLONG slSize, BOOL bPrefetched) {
+  ZipCacheEntry *pze = FindCachedEntry(fnmFile, iType);
+
+  // Already cached
+  if (pze != NULL) {
+    free(pubData);
+    return pze;
+  }
+
+  pze = new ZipCacheEntry;
+  pze->ze_fnmFile = fnmFile;
+  pze->ze_iType = iType;
+  pze->ze_pubData = pubData;
+  pze->ze_slSize = slSize;
+  pze->ze_bPrefetched = bPrefetched;
+
+  IStreamStats::BufferAllocated(pubData, slSize, IStreamStats::EBO_ZIPCACHE, fnmFile);
+
+  _lhZipCache.AddHead(pze->ze_lnInCache);
+  _slZipCacheMemory += slSize;
+
+  if (bPrefetched) {
+    _slPrefetchMemory += slSize;
+  }
+
+  return pze;
+};
+
+// Decompress an entry into the cache and open stream from it (FALSE if it shouldn't be cached)
+BOOL IZipCache::Add_t(CUnpageStreamPatch &strm, const CTFileName &fnmFile, INDEX iType, INDEX iHandle, SLONG slSize) {
+  if (!FitsIntoCache(slSize)) return FALSE;
+
+  UBYTE *pubData = AllocEntryBuffer(slSize);
+  if (pubData == NULL) return FALSE;
+
+  try {
+    IUnzip::ReadBlock_t(iHandle, pubData, 0, slSize);
+
+  } catch (char *) {
+    free(pubData);
+    throw;
+  }
+
+  CTSingleLock slCache(&_csZipCache, TRUE);
+
+  // Share it before evicting anything, so it stays alive
+  ZipCacheEntry *pze = AddCachedEntry(fnmFile, iType, pubData, slSize, FALSE);
+  ShareCachedEntry(strm, pze);
+
+  EvictCachedEntries(_EnginePatches._iZipCacheSize * 1024);
+  return TRUE;
+};
+
+// Stop reading contents of a cached entry (FALSE if the buffer isn't from the cache)
+BOOL IZipCache::Release(UBYTE *pubData) {
+  // Nothing is being read from the cache
+  // [Cecil] NOTE: Checked without the lock, since a shared buffer keeps the count above zero until it's released
+  if (_aShared.Count() == 0) return FALSE;
+
+  CTSingleLock slCache(&_csZipCache, TRUE);
+
+  for (INDEX i = 0; i < _aShared.Count(); i++) {
+    ZipCacheEntry *pze = _aShared[i];
+    if (pze->ze_pubData != pubData) continue;
+
+    if (--pze->ze_ctRefs == 0) {
+      _aShared[i] = _aShared[_aShared.Count() - 1];
+      _aShared.Pop();
+
+      if (pze->ze_bDiscarded) {
+        DeleteCachedEntry(pze);
+      }
+    }
+
+    return TRUE;
+  }
+
+  return FALSE;
+};
+
+// Decompress a whole entry into a new buffer in chunks (NULL if it shouldn't be prefetched)
+static UBYTE *DecompressEntry(const CTFileName &fnmFile, SLONG &slSize) {
+  INDEX iHandle;
+
+  {
+    CTSingleLock slUnzip(&_csUnzip, TRUE);
+    iHandle = IUnzip::Open_t(fnmFile);
+    slSize = IUnzip::GetSize(iHandle);
+  }
+
+  // Wouldn't be kept anyway or it would push out prefetched entries that haven't been opened yet
+  BOOL bFits = FitsIntoCache(slSize);
+
+  if (bFits) {
+    CTSingleLock slCache(&_csZipCache, TRUE);
+    bFits = (_slPrefetchMemory + slSize <= _EnginePatches._iZipCacheSize * 1024);
+  }
+
+  UBYTE *pubData = NULL;
+
+  try {
+    if (bFits) {
+      pubData = AllocEntryBuffer(slSize);
+
+      // Let the loading thread open other entries in between
+      for (SLONG slDone = 0; pubData != NULL && slDone < slSize; slDone += _slPrefetchChunk) {
+        CTSingleLock slUnzip(&_csUnzip, TRUE);
+        IUnzip::ReadBlock_t(iHandle, pubData + slDone, slDone, Min(_slPrefetchChunk, slSize - slDone));
+      }
+    }
+
+  } catch (char *) {
+    if (pubData != NULL) free(pubData);
+
+    CTSingleLock slUnzip(&_csUnzip, TRUE);
+    IUnzip::Close(iHandle);
+    throw;
+  }
+
+  CTSingleLock slUnzip(&_csUnzip, TRUE);
+  IUnzip::Close(iHandle);
+
+  return pubData;
+};
+
+// Decompress an entry ahead of time
+void IZipCache::Prefetch(const CTFileName &fnmFile, INDEX iType) {
+  ZipPrefetch *pzp;
+
+  {
+    CTSingleLock slCache(&_csZipCache, TRUE);
+
+    // Already cached or being decompressed
+    if (FindCachedEntry(fnmFile, iType) != NULL || FindPrefetch(fnmFile, iType) != -1) return;
+
+    pzp = new ZipPrefetch;
+    pzp->zp_fnmFile = fnmFile;
+    pzp->zp_iType = iType;
+    pzp->zp_hDone = CreateEventA(NULL, TRUE, FALSE, NULL);
+    pzp->zp_ctRefs = 1;
+
+    _aPrefetching.Push() = pzp;
+  }
+
+  UBYTE *pubData = NULL;
+  SLONG slSize = 0;
+  char *strError = NULL;
+
+  try {
+    pubData = DecompressEntry(fnmFile, slSize);
+
+  } catch (char *strDecompressError) {
+    strError = strDecompressError;
+  }
+
+  // Cache it and let waiting threads open it
+  CTSingleLock slCache(&_csZipCache, TRUE);
+
+  if (pubData != NULL) {
+    AddCachedEntry(fnmFile, iType, pubData, slSize, TRUE);
+    EvictCachedEntries(_EnginePatches._iZipCacheSize * 1024);
+  }
+
+  const INDEX iPrefetch = FindPrefetch(fnmFile, iType);
+  _aPrefetching[iPrefetch] = _aPrefetching[_aPrefetching.Count() - 1];
+  _aPrefetching.Pop();
+
+  SetEvent(pzp->zp_hDone);
+  ReleasePrefetch(pzp);
+
+  if (strError != NULL) throw strError;
+};
+
+// Forget all cached entries (entries that are being read are freed once they're closed)
+void IZipCache::Clear(void) {
+  CTSingleLock slCache(&_csZipCache, TRUE);
+  EvictCachedEntries(0);
+};
+
+// ZIP entry that's being decompressed as it's read
+struct ZipWindowStream {
+  INDEX iHandle; // ZIP handle of the stream
+  UBYTE *pubBuffer; // Reserved stream buffer
+  SLONG slReserved; // Reserved size with padding
+  SLONG slSize; // Full decompressed size
+  SLONG slCommitted; // How much of the buffer is accessible
+  SLONG slDecompressed; // How much has been decompressed so far
+  SLONG slWindow; // How much to decompress at once
+};
+
+static CStaticStackArray<ZipWindowStream> _aWindowStreams;
+static CTCriticalSection _csZipWindows;
+
+// Vectored exception handler functions from kernel32
+typedef LONG (WINAPI *CVectoredHandlerFunc)(EXCEPTION_POINTERS *);
+typedef PVOID (WINAPI *CAddVectoredHandlerFunc)(ULONG, CVectoredHandlerFunc);
+typedef ULONG (WINAPI *CRemoveVectoredHandlerFunc)(PVOID);
+
+// Handler of access to reserved stream buffers
+static PVOID _pWindowHandler = NULL;
+
+// Reserved buffers with access handled elsewhere
+struct WatchedBuffer {
+  UBYTE *pubBuffer;
+  SLONG slReserved;
+  IZipWindow::CAccessFunc pFunc;
+  void *pData;
+};
+
+static CStaticStackArray<WatchedBuffer> _aWatched;
+
+// Make stream contents accessible and decompress them until a certain position
+static void DecompressWindows(ZipWindowStream &zws, SLONG slUntil) {
+  // Commit pages up to the next window, including the padding after the end
+  SLONG slTarget = ((slUntil + zws.slWindow - 1) / zws.slWindow) * zws.slWindow;
+  slTarget = Min(slTarget, zws.slReserved);
+
+  if (slTarget > zws.slCommitted) {
+    VirtualAlloc(zws.pubBuffer + zws.slCommitted, slTarget - zws.slCommitted, MEM_COMMIT, PAGE_READWRITE);
+    zws.slCommitted = slTarget;
+  }
+
+  // Decompress everything before it, since entries can only be decompressed sequentially
+  slTarget = Min(slTarget, zws.slSize);
+  if (slTarget <= zws.slDecompressed) return;
+
+  IUnzip::ReadBlock_t(zws.iHandle, zws.pubBuffer + zws.slDecompressed, zws.slDecompressed, slTarget - zws.slDecompressed);
+
+  IStreamStats::Decompressed(slTarget - zws.slDecompressed);
+  zws.slDecompressed = slTarget;
+};
+
+// Decompress stream contents when something tries to read past what's accessible
+// [Cecil] NOTE: Unlike the engine's own paging, this also works for any direct access to the buffer on any thread
+static LONG WINAPI HandleWindowAccess(EXCEPTION_POINTERS *pExc) {
+  const EXCEPTION_RECORD &er = *pExc->ExceptionRecord;
+
+  if (er.ExceptionCode != EXCEPTION_ACCESS_VIOLATION || er.NumberParameters < 2) return EXCEPTION_CONTINUE_SEARCH;
+  if (_aWindowStreams.Count() == 0 && _aWatched.Count() == 0) return EXCEPTION_CONTINUE_SEARCH;
+
+  const UBYTE *pubAddress = (const UBYTE *)er.ExceptionInformation[1];
+
+  CTSingleLock slUnzip(&_csUnzip, TRUE);
+  CTSingleLock slWindows(&_csZipWindows, TRUE);
+
+  for (INDEX i = 0; i < _aWindowStreams.Count(); i++) {
+    ZipWindowStream &zws = _aWindowStreams[i];
+
+    // Not in this buffer or it's already accessible
+    if (pubAddress < zws.pubBuffer || pubAddress >= zws.pubBuffer + zws.slReserved) continue;
+    if (pubAddress < zws.pubBuffer + zws.slCommitted) return EXCEPTION_CONTINUE_SEARCH;
+
+    try {
+      DecompressWindows(zws, (pubAddress - zws.pubBuffer) + 1);
+
+    // Let the engine report it as a crash
+    } catch (char *) {
+      return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    return EXCEPTION_CONTINUE_EXECUTION;
+  }
+
+  for (INDEX iWatched = 0; iWatched < _aWatched.Count(); iWatched++) {
+    const WatchedBuffer &wb = _aWatched[iWatched];
+    if (pubAddress < wb.pubBuffer || pubAddress >= wb.pubBuffer + wb.slReserved) continue;
+
+    return wb.pFunc(wb.pData, pubAddress) ? EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH;
+  }
+
+  return EXCEPTION_CONTINUE_SEARCH;
+};
+
+// Start handling access to stream buffers
+static BOOL InstallWindowHandler(void) {
+  if (_pWindowHandler != NULL) return TRUE;
+
+  // Not available before Windows XP
+  CAddVectoredHandlerFunc pAddHandler = (CAddVectoredHandlerFunc)GetProcAddress(
+    GetModuleHandleA("kernel32.dll"), "AddVectoredExceptionHandler");
+
+  if (pAddHandler == NULL) return FALSE;
+
+  _pWindowHandler = pAddHandler(TRUE, &HandleWindowAccess);
+  return (_pWindowHandler != NULL);
+};
+
+// Start decompressing a ZIP entry into the stream as it's being read (FALSE if it should be decompressed at once)
+BOOL IZipWindow::Start(CUnpageStreamPatch &strm, INDEX iHandle, SLONG slSize) {
+  const SLONG slWindow = _EnginePatches._iZipWindowSize * 1024;
+  if (slWindow <= 0 || slSize <= slWindow) return FALSE;
+
+  if (!InstallWindowHandler()) return FALSE;
+
+  // Reserve the buffer without making it accessible
+  const DOUBLE dStartTime = IStreamStats::Now();
+  const SLONG slReserved = (slSize / 64 + 2) * 64;
+
+  UBYTE *pubBuffer = (UBYTE *)VirtualAlloc(NULL, slReserved, MEM_RESERVE, PAGE_NOACCESS);
+  if (pubBuffer == NULL) return FALSE;
+
+  CTSingleLock slWindows(&_csZipWindows, TRUE);
+
+  ZipWindowStream &zws = _aWindowStreams.Push();
+  zws.iHandle = iHandle;
+  zws.pubBuffer = pubBuffer;
+  zws.slReserved = slReserved;
+  zws.slSize = slSize;
+  zws.slCommitted = 0;
+  zws.slDecompressed = 0;
+  zws.slWindow = ClampDn(slWindow, SLONG(64 * 1024));
+
+  strm.strm_pubBufferBegin = pubBuffer;
+  strm.strm_pubBufferEnd = pubBuffer + slReserved;
+  strm.strm_pubCurrentPos = pubBuffer;
+  strm.strm_pubMaxPos = pubBuffer;
+  strm.strm_pubEOF = pubBuffer + slSize;
+
+  IStreamStats::Allocated(&strm, slReserved, FALSE, dStartTime);
+
+  // Decompress the first window right away for file headers
+  DecompressWindows(zws, 1);
+  return TRUE;
+};
+
+// Free stream buffer if it's being decompressed in windows
+BOOL IZipWindow::Free(UBYTE *pubBuffer) {
+  // No streams are being decompressed
+  if (_aWindowStreams.Count() == 0) return FALSE;
+
+  CTSingleLock slWindows(&_csZipWindows, TRUE);
+
+  for (INDEX i = 0; i < _aWindowStreams.Count(); i++) {
+    if (_aWindowStreams[i].pubBuffer != pubBuffer) continue;
+
+    VirtualFree(pubBuffer, 0, MEM_RELEASE);
+
+    _aWindowStreams[i] = _aWindowStreams[_aWindowStreams.Count() - 1];
+    _aWindowStreams.Pop();
+    return TRUE;
+  }
+
+  return FALSE;
+};
+
+// Let some function make parts of a reserved buffer accessible when they're accessed (FALSE if it's not possible)
+BOOL IZipWindow::Watch(UBYTE *pubBuffer, SLONG slReserved, CAccessFunc pFunc, void *pData) {
+  if (!InstallWindowHandler()) return FALSE;
+
+  CTSingleLock slWindows(&_csZipWindows, TRUE);
+
+  WatchedBuffer &wb = _aWatched.Push();
+  wb.pubBuffer = pubBuffer;
+  wb.slReserved = slReserved;
+  wb.pFunc = pFunc;
+  wb.pData = pData;
+  return TRUE;
+};
+
+// Stop handling access to a reserved buffer
+void IZipWindow::Unwatch(UBYTE *pubBuffer) {
+  CTSingleLock slWindows(&_csZipWindows, TRUE);
+
+  for (INDEX i = 0; i < _aWatched.Count(); i++) {
+    if (_aWatched[i].pubBuffer != pubBuffer) continue;
+
+    _aWatched[i] = _aWatched[_aWatched.Count() - 1];
+    _aWatched.Pop();
+    return;
+  }
+};
+
+// Stop handling access to stream buffers
+void IZipWindow::Stop(void) {
+  if (_pWindowHandler == NULL) return;
+
+  CRemoveVectoredHandlerFunc pRemoveHandler = (CRemoveVectoredHandlerFunc)GetProcAddress(
+    GetModuleHandleA("kernel32.dll"), "RemoveVectoredExceptionHandler");
+
+  if (pRemoveHandler != NULL) {
+    pRemoveHandler(_pWindowHandler);
+  }
+
+  _pWindowHandler = NULL;
+};
+
+// Backend for reading loose files
+static CAsyncIO *_pFileReadIO = NULL;
+
+// Files that have been submitted for reading (oldest ones first)
+static CStaticStackArray<CAsyncRead *> _aFileReads;
+static SLONG _slFileReadMemory = 0; // Memory reserved for all submitted files
+static CTCriticalSection _csFileReads;
+
+// Find read of some file
+static INDEX FindFileRead(const CTFileName &fnmFile) {
+  for (INDEX i = 0; i < _aFileReads.Count(); i++) {
+    if (_aFileReads[i]->ar_fnmFile == fnmFile) return i;
+  }
+
+  return -1;
+};
+
+// Remove read from the list while keeping the order
+static CAsyncRead *TakeFileRead(INDEX iRead) {
+  CAsyncRead *pread = _aFileReads[iRead];
+  const INDEX ct = _aFileReads.Count();
+
+  for (INDEX i = iRead; i < ct - 1; i++) {
+    _aFileReads[i] = _aFileReads[i + 1];
+  }
+
+  _aFileReads.Pop();
+  _slFileReadMemory -= pread->ar_slReserved;
+
+  return pread;
+};
+
+// Discard the oldest completed reads until reserved memory fits into the budget
+static void EvictFileReads(SLONG slBudget) {
+  INDEX iRead = 0;
+
+  while (_slFileReadMemory > slBudget && iRead < _aFileReads.Count()) {
+    CAsyncRead *pread = _aFileReads[iRead];
+
+    // Can't discard it while it's being read
+    if (pread->ar_eState == CAsyncRead::E_PENDING) {
+      iRead++;
+      continue;
+    }
+
+    delete TakeFileRead(iRead);
+  }
+};
+
+// Start reading a batch of files
+void IFileReads::Submit(const CTFileName *afnmFiles, INDEX ct) {
+  // Nowhere to keep read contents
+  if (_EnginePatches._iZipCacheSize <= 0) return;
+
+  const SLONG slBudget = _EnginePatches._iZipCacheSize * 1024;
+  CTSingleLock slReads(&_csFileReads, TRUE);
+
+  if (_pFileReadIO == NULL) {
+    const INDEX ctThreads = Clamp(_EnginePatches._iPrefetchThreads, (INDEX)1, (INDEX)8);
+    _pFileReadIO = CAsyncIO::Create(CAsyncIO::E_THREADPOOL, ctThreads);
+  }
+
+  CStaticStackArray<CAsyncRead *> aBatch;
+
+  for (INDEX i = 0; i < ct; i++) {
+    // Already being read
+    if (FindFileRead(afnmFiles[i]) != -1) continue;
+
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesExA(afnmFiles[i].str_String, GetFileExInfoStandard, &fad)) continue;
+
+    // Way too big to keep around
+    const SLONG slSize = fad.nFileSizeLow;
+    if (fad.nFileSizeHigh != 0 || slSize < 0 || slSize > slBudget) continue;
+
+    // Make room for the whole file before reading it and stop once the rest can't fit
+    EvictFileReads(slBudget - slSize);
+    if (_slFileReadMemory + slSize > slBudget) break;
+
+    CAsyncRead *pread = new CAsyncRead(afnmFiles[i]);
+    pread->ar_slReserved = slSize;
+
+    _aFileReads.Push() = pread;
+    _slFileReadMemory += slSize;
+
+    aBatch.Push() = pread;
+  }
+
+  if (aBatch.Count() != 0) {
+    _pFileReadIO->Submit(&aBatch[0], aBatch.Count());
+  }
+};
+
+// Open stream from a background read of a file, if there is one
+BOOL IFileReads::Open(CUnpageStreamPatch &strm, const CTFileName &fnmFile) {
+  // Nothing has been submitted
+  if (_aFileReads.Count() == 0) return FALSE;
+
+  CAsyncRead *pread;
+
+  {
+    CTSingleLock slReads(&_csFileReads, TRUE);
+    const INDEX iRead = FindFileRead(fnmFile);
+
+    if (iRead == -1) return FALSE;
+    pread = TakeFileRead(iRead);
+  }
+
+  // Wait for it to finish reading
+  _pFileReadIO->Wait(*pread);
+
+  // File may have been changed on disk since it has been read
+  WIN32_FILE_ATTRIBUTE_DATA fad;
+
+  if (pread->ar_eState != CAsyncRead::E_DONE
+   || !GetFileAttributesExA(fnmFile.str_String, GetFileExInfoStandard, &fad)
+   || fad.nFileSizeHigh != 0 || fad.nFileSizeLow != (DWORD)pread->ar_slSize
+   || CompareFileTime(&fad.ftLastWriteTime, &pread->ar_ftWritten) != 0) {
+    delete pread;
+    return FALSE;
+  }
+
+  // Hand read contents over to the stream
+  strm.AdoptBuffer(pread->Detach(), pread->ar_slSize);
+
+  delete pread;
+  return TRUE;
+};
+
+// Forget background read of a file that's about to be overwritten
+void IFileReads::Drop(const CTFileName &fnmFile) {
+  if (_aFileReads.Count() == 0) return;
+
+  CAsyncRead *pread;
+
+  {
+    CTSingleLock slReads(&_csFileReads, TRUE);
+    const INDEX iRead = FindFileRead(fnmFile);
+
+    if (iRead == -1) return;
+    pread = TakeFileRead(iRead);
+  }
+
+  _pFileReadIO->Wait(*pread);
+  delete pread;
+};
+
+// Drop all reads and stop the backend
+void IFileReads::Stop(void) {
+  CTSingleLock slReads(&_csFileReads, TRUE);
+
+  if (_pFileReadIO == NULL) return;
+
+  // Fails every read that hasn't started yet
+  _pFileReadIO->Stop();
+
+  for (INDEX i = 0; i < _aFileReads.Count(); i++) {
+    delete _aFileReads[i];
+  }
+
+  _aFileReads.PopAll();
+  _slFileReadMemory = 0;
+
+  delete _pFileReadIO;
+  _pFileReadIO = NULL;
+};
+
+#endif // _PATCHCONFIG_FIX_STREAMPAGING
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,436 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "UnpageStreams.h"
+
+#if _PATCHCONFIG_FIX_STREAMPAGING
+
+// Names of stream layers for reports
+static const char *_astrLayerNames[IStreamStats::ESL_MAX] = {
+  "file", "modzip", "basezip", "zipcache", "update", "create",
+};
+
+// Names of buffer owners for reports
+static const char *_astrOwnerNames[IStreamStats::EBO_MAX] = {
+  "memory", "file", "zip", "remlevel", "demo", "zipcache", "fileread", "spill",
+};
+
+// Stream buffer or some other long-lived buffer that's currently allocated
+struct LiveBuffer {
+  const void *pKey; // Stream that owns the buffer or the buffer itself
+  CTStream *pstrm; // Stream that owns the buffer (NULL for other buffers)
+  CTString strDescription; // What other buffers contain
+  SLONG slSize; // Allocated memory
+  IStreamStats::EBufferOwner eOwner; // What the buffer is used for
+  BOOL bLargePages; // Allocated with large pages
+};
+
+// Counters that are accumulated from any thread without locking
+struct PendingCounters {
+  LONG alOpened[IStreamStats::ESL_MAX];
+  LONG alOpenTime[IStreamStats::ESL_MAX]; // In microseconds
+  LONG lClosed;
+  LONG lCloseTime;
+  LONG lAllocations;
+  LONG lFrees;
+  LONG lAllocTime;
+  LONG lBytesRead;
+  LONG lBytesDecompressed;
+  LONG lBytesWritten;
+  LONG lLargePages;
+  LONG lLargePageFallbacks;
+};
+
+// Collected statistics
+static IStreamStats::Stats _ssStats;
+static PendingCounters _pcPending;
+static CTCriticalSection _csStats;
+
+// Live buffers hashed by their keys
+static const INDEX _ctLiveBuckets = 256;
+static CStaticStackArray<LiveBuffer> _aLiveBuckets[_ctLiveBuckets];
+static INDEX _ctLiveBuffers = 0;
+
+// Currently allocated stream buffers
+static __int64 _llLiveMemory = 0;
+static __int64 _llPeakMemory = 0;
+
+// Time since some moment in microseconds for counters
+static inline LONG Elapsed(DOUBLE dStartTime) {
+  // Started before the timer has been created
+  if (dStartTime <= 0.0) return 0;
+
+  return LONG(Clamp(IStreamStats::Now() - dStartTime, 0.0, 1000.0) * 1e6);
+};
+
+// Move pending counters into statistics (under the statistics lock)
+static void MoveCounters(void) {
+  PendingCounters &pc = _pcPending;
+  IStreamStats::Stats &ss = _ssStats;
+
+  for (INDEX i = 0; i < IStreamStats::ESL_MAX; i++) {
+    ss.actOpened[i] += InterlockedExchange(&pc.alOpened[i], 0);
+    ss.adOpenTime[i] += InterlockedExchange(&pc.alOpenTime[i], 0) / 1e6;
+  }
+
+  ss.ctClosed += InterlockedExchange(&pc.lClosed, 0);
+  ss.dCloseTime += InterlockedExchange(&pc.lCloseTime, 0) / 1e6;
+  ss.ctAllocations += InterlockedExchange(&pc.lAllocations, 0);
+  ss.ctFrees += InterlockedExchange(&pc.lFrees, 0);
+  ss.dAllocTime += InterlockedExchange(&pc.lAllocTime, 0) / 1e6;
+  ss.llBytesRead += InterlockedExchange(&pc.lBytesRead, 0);
+  ss.llBytesDecompressed += InterlockedExchange(&pc.lBytesDecompressed, 0);
+  ss.llBytesWritten += InterlockedExchange(&pc.lBytesWritten, 0);
+  ss.ctLargePages += InterlockedExchange(&pc.lLargePages, 0);
+  ss.ctLargePageFallbacks += InterlockedExchange(&pc.lLargePageFallbacks, 0);
+
+  ss.llLiveMemory = _llLiveMemory;
+  ss.llPeakMemory = _llPeakMemory;
+};
+
+// Add to a pending counter and move all of them into statistics before it can overflow
+static inline void AddPending(LONG &lCounter, LONG lAdd) {
+  if (InterlockedExchangeAdd(&lCounter, lAdd) < 0x40000000) return;
+
+  CTSingleLock slStats(&_csStats, TRUE);
+  MoveCounters();
+};
+
+// Get bucket of live buffers for some key
+static inline CStaticStackArray<LiveBuffer> &LiveBucket(const void *pKey) {
+  const ULONG ulKey = (ULONG)(size_t)pKey;
+  return _aLiveBuckets[((ulKey >> 4) ^ (ulKey >> 12)) % _ctLiveBuckets];
+};
+
+// Find live buffer by its key
+static LiveBuffer *FindLiveBuffer(const void *pKey) {
+  CStaticStackArray<LiveBuffer> &aBucket = LiveBucket(pKey);
+
+  for (INDEX i = 0; i < aBucket.Count(); i++) {
+    if (aBucket[i].pKey == pKey) return &aBucket[i];
+  }
+
+  return NULL;
+};
+
+// Start tracking a live buffer
+static LiveBuffer &AddLiveBuffer(const void *pKey, SLONG slSize, IStreamStats::EBufferOwner eOwner) {
+  LiveBuffer &buf = LiveBucket(pKey).Push();
+  buf.pKey = pKey;
+  buf.pstrm = NULL;
+  buf.strDescription = "";
+  buf.slSize = slSize;
+  buf.eOwner = eOwner;
+  buf.bLargePages = FALSE;
+
+  _ctLiveBuffers++;
+  _llLiveMemory += slSize;
+  _llPeakMemory = Max(_llPeakMemory, _llLiveMemory);
+
+  return buf;
+};
+
+// Stop tracking a live buffer
+static void RemoveLiveBuffer(const void *pKey) {
+  CStaticStackArray<LiveBuffer> &aBucket = LiveBucket(pKey);
+  const INDEX ct = aBucket.Count();
+
+  for (INDEX i = 0; i < ct; i++) {
+    if (aBucket[i].pKey != pKey) continue;
+
+    _ctLiveBuffers--;
+    _llLiveMemory -= aBucket[i].slSize;
+
+    // Replace with the last buffer
+    if (i != ct - 1) {
+      aBucket[i] = aBucket[ct - 1];
+    }
+
+    aBucket.Pop();
+    return;
+  }
+};
+
+// Stream has been opened or created
+void IStreamStats::Opened(CTStream *pstrm, EStreamLayer eLayer, SLONG slRead, SLONG slDecompressed, DOUBLE dStartTime) {
+  AddPending(_pcPending.alOpened[eLayer], 1);
+  AddPending(_pcPending.alOpenTime[eLayer], Elapsed(dStartTime));
+  AddPending(_pcPending.lBytesRead, slRead);
+  AddPending(_pcPending.lBytesDecompressed, slDecompressed);
+
+  // Buffers of opened streams belong to files unless specified otherwise
+  CTSingleLock slStats(&_csStats, TRUE);
+  LiveBuffer *pbuf = FindLiveBuffer(pstrm);
+
+  if (pbuf != NULL && pbuf->eOwner == EBO_MEMORY) {
+    const BOOL bZip = (eLayer == ESL_MODZIP || eLayer == ESL_BASEZIP || eLayer == ESL_CACHE);
+    pbuf->eOwner = (bZip ? EBO_ZIP : EBO_FILE);
+  }
+};
+
+// More of a stream has been decompressed after opening it
+void IStreamStats::Decompressed(SLONG slDecompressed) {
+  AddPending(_pcPending.lBytesDecompressed, slDecompressed);
+};
+
+// Stream has been closed
+void IStreamStats::Closed(SLONG slWritten, DOUBLE dStartTime) {
+  AddPending(_pcPending.lClosed, 1);
+  AddPending(_pcPending.lCloseTime, Elapsed(dStartTime));
+  AddPending(_pcPending.lBytesWritten, slWritten);
+};
+
+// Stream buffer has been allocated
+void IStreamStats::Allocated(CTStream *pstrm, SLONG slBytes, BOOL bLargePages, DOUBLE dStartTime) {
+  AddPending(_pcPending.lAllocations, 1);
+  AddPending(_pcPending.lAllocTime, Elapsed(dStartTime));
+
+  CTSingleLock slStats(&_csStats, TRUE);
+  LiveBuffer &buf = AddLiveBuffer(pstrm, slBytes, EBO_MEMORY);
+  buf.pstrm = pstrm;
+  buf.bLargePages = bLargePages;
+};
+
+// Stream buffer has been freed
+void IStreamStats::Freed(CTStream *pstrm) {
+  AddPending(_pcPending.lFrees, 1);
+
+  // Does nothing if it has been allocated before the tracking has started
+  CTSingleLock slStats(&_csStats, TRUE);
+  RemoveLiveBuffer(pstrm);
+};
+
+// Specify what a stream buffer is used for
+void IStreamStats::SetOwner(CTStream *pstrm, EBufferOwner eOwner) {
+  CTSingleLock slStats(&_csStats, TRUE);
+  LiveBuffer *pbuf = FindLiveBuffer(pstrm);
+
+  if (pbuf != NULL) {
+    pbuf->eOwner = eOwner;
+  }
+};
+
+// Some other long-lived buffer has been allocated
+void IStreamStats::BufferAllocated(const void *pBuffer, SLONG slBytes, EBufferOwner eOwner, const CTString &strDescription) {
+  if (pBuffer == NULL) return;
+
+  CTSingleLock slStats(&_csStats, TRUE);
+  AddLiveBuffer(pBuffer, slBytes, eOwner).strDescription = strDescription;
+};
+
+// Some other long-lived buffer has been freed or handed over to a stream
+void IStreamStats::BufferFreed(const void *pBuffer) {
+  if (pBuffer == NULL) return;
+
+  CTSingleLock slStats(&_csStats, TRUE);
+  RemoveLiveBuffer(pBuffer);
+};
+
+// Large pages have been requested for a stream buffer
+void IStreamStats::LargePages(BOOL bObtained) {
+  if (bObtained) {
+    AddPending(_pcPending.lLargePages, 1);
+  } else {
+    AddPending(_pcPending.lLargePageFallbacks, 1);
+  }
+};
+
+// Retrieve a copy of current statistics
+void IStreamStats::Get(Stats &ss) {
+  CTSingleLock slStats(&_csStats, TRUE);
+  MoveCounters();
+
+  ss = _ssStats;
+};
+
+// Convert bytes into megabytes
+static inline DOUBLE ToMB(__int64 llBytes) {
+  return DOUBLE(llBytes) / (1024.0 * 1024.0);
+};
+
+// Print statistics into the console
+void IStreamStats::Print(void) {
+  Stats ss;
+  Get(ss);
+
+  CPutString(TRANS("Stream statistics:\n"));
+
+  for (INDEX i = 0; i < ESL_MAX; i++) {
+    CPrintF("  %-8s: %6d opened in %.3fs\n", _astrLayerNames[i], ss.actOpened[i], ss.adOpenTime[i]);
+  }
+
+  CPrintF(TRANS("  %d closed in %.3fs\n"), ss.ctClosed, ss.dCloseTime);
+  CPrintF(TRANS("  %d allocations in %.3fs, %d frees\n"), ss.ctAllocations, ss.dAllocTime, ss.ctFrees);
+
+  CPrintF(TRANS("  Read: %.2f MB, decompressed: %.2f MB, written: %.2f MB\n"),
+    ToMB(ss.llBytesRead), ToMB(ss.llBytesDecompressed), ToMB(ss.llBytesWritten));
+
+  CPrintF(TRANS("  Buffer memory: %.2f MB live, %.2f MB peak\n"), ToMB(ss.llLiveMemory), ToMB(ss.llPeakMemory));
+  CPrintF(TRANS("  Large pages: %d obtained, %d fallbacks\n"), ss.ctLargePages, ss.ctLargePageFallbacks);
+};
+
+// Live buffer with a copy of its description
+struct BufferReport {
+  CTString strDescription;
+  SLONG slSize;
+  IStreamStats::EBufferOwner eOwner;
+  BOOL bLargePages;
+};
+
+// Sort buffer reports from the largest ones
+static int CompareBufferReports(const void *pElement1, const void *pElement2) {
+  const BufferReport &rep1 = **(const BufferReport **)pElement1;
+  const BufferReport &rep2 = **(const BufferReport **)pElement2;
+
+  if (rep1.slSize > rep2.slSize) return -1;
+  if (rep1.slSize < rep2.slSize) return +1;
+  return 0;
+};
+
+// Print currently allocated stream buffers into the console
+void IStreamStats::PrintBuffers(void) {
+  CDynamicStackArray<BufferReport> aReports;
+  __int64 llLive, llPeak;
+
+  // Copy everything while streams can't free their buffers
+  {
+    CTSingleLock slStats(&_csStats, TRUE);
+
+    if (_ctLiveBuffers > 0) aReports.Push(_ctLiveBuffers);
+    INDEX iReport = 0;
+
+    for (INDEX iBucket = 0; iBucket < _ctLiveBuckets; iBucket++) {
+      CStaticStackArray<LiveBuffer> &aBucket = _aLiveBuckets[iBucket];
+
+      for (INDEX i = 0; i < aBucket.Count(); i++) {
+        const LiveBuffer &buf = aBucket[i];
+        BufferReport &rep = aReports[iReport++];
+
+        rep.strDescription = (buf.pstrm != NULL) ? buf.pstrm->strm_strStreamDescription : buf.strDescription;
+        rep.slSize = buf.slSize;
+        rep.eOwner = buf.eOwner;
+        rep.bLargePages = buf.bLargePages;
+      }
+    }
+
+    llLive = _llLiveMemory;
+    llPeak = _llPeakMemory;
+  }
+
+  const INDEX ct = aReports.Count();
+  CPrintF(TRANS("%d stream buffers: %.2f MB live, %.2f MB peak\n"), ct, ToMB(llLive), ToMB(llPeak));
+
+  if (ct == 0) return;
+
+  // Memory per owner
+  INDEX actOwner[EBO_MAX] = { 0 };
+  __int64 allOwner[EBO_MAX] = { 0 };
+
+  __int64 llLargePages = 0;
+
+  for (INDEX iReport = 0; iReport < ct; iReport++) {
+    actOwner[aReports[iReport].eOwner]++;
+    allOwner[aReports[iReport].eOwner] += aReports[iReport].slSize;
+
+    if (aReports[iReport].bLargePages) {
+      llLargePages += aReports[iReport].slSize;
+    }
+  }
+
+  for (INDEX iOwner = 0; iOwner < EBO_MAX; iOwner++) {
+    if (actOwner[iOwner] == 0) continue;
+    CPrintF("  %-8s: %4d, %.2f MB\n", _astrOwnerNames[iOwner], actOwner[iOwner], ToMB(allOwner[iOwner]));
+  }
+
+  if (llLargePages > 0) {
+    CPrintF(TRANS("  %.2f MB in large pages\n"), ToMB(llLargePages));
+  }
+
+  // Largest consumers
+  qsort(aReports.da_Pointers, ct, sizeof(BufferReport *), &CompareBufferReports);
+
+  const INDEX ctLargest = Min(ct, (INDEX)10);
+  CPrintF(TRANS("Largest %d:\n"), ctLargest);
+
+  for (INDEX iLargest = 0; iLargest < ctLargest; iLargest++) {
+    const BufferReport &rep = aReports[iLargest];
+    CPrintF("  %8.2f MB  %-8s %c %s\n", ToMB(rep.slSize), _astrOwnerNames[rep.eOwner], (rep.bLargePages ? 'L' : ' '), rep.strDescription.str_String);
+  }
+};
+
+// Dump statistics into a JSON file
+void IStreamStats::Dump(void *pArgs) {
+  CTString strFile = *NEXTARGUMENT(CTString *);
+
+  if (strFile == "") {
+    strFile = "Temp\\StreamStats.json";
+  }
+
+  Stats ss;
+  Get(ss);
+
+  try {
+    CTFileStream strm;
+    strm.Create_t(CTFileName(strFile));
+
+    strm.FPrintF_t("{\n  \"opened\": {");
+
+    for (INDEX iOpened = 0; iOpened < ESL_MAX; iOpened++) {
+      strm.FPrintF_t("%s \"%s\": %d", (iOpened == 0 ? "" : ","), _astrLayerNames[iOpened], ss.actOpened[iOpened]);
+    }
+
+    strm.FPrintF_t(" },\n  \"open_seconds\": {");
+
+    for (INDEX iTime = 0; iTime < ESL_MAX; iTime++) {
+      strm.FPrintF_t("%s \"%s\": %.6f", (iTime == 0 ? "" : ","), _astrLayerNames[iTime], ss.adOpenTime[iTime]);
+    }
+
+    strm.FPrintF_t(" },\n");
+    strm.FPrintF_t("  \"closed\": %d,\n  \"close_seconds\": %.6f,\n", ss.ctClosed, ss.dCloseTime);
+    strm.FPrintF_t("  \"allocations\": %d,\n  \"frees\": %d,\n  \"alloc_seconds\": %.6f,\n", ss.ctAllocations, ss.ctFrees, ss.dAllocTime);
+    strm.FPrintF_t("  \"bytes_read\": %I64d,\n", ss.llBytesRead);
+    strm.FPrintF_t("  \"bytes_decompressed\": %I64d,\n", ss.llBytesDecompressed);
+    strm.FPrintF_t("  \"bytes_written\": %I64d,\n", ss.llBytesWritten);
+    strm.FPrintF_t("  \"live_memory\": %I64d,\n", ss.llLiveMemory);
+    strm.FPrintF_t("  \"peak_memory\": %I64d,\n", ss.llPeakMemory);
+    strm.FPrintF_t("  \"large_pages\": %d,\n  \"large_page_fallbacks\": %d\n}\n", ss.ctLargePages, ss.ctLargePageFallbacks);
+
+    strm.Close();
+    CPrintF(TRANS("Dumped stream statistics into '%s'\n"), strFile.str_String);
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Cannot dump stream statistics:\n%s\n"), strError);
+  }
+};
+
+// Reset all counters except for currently allocated memory
+void IStreamStats::Reset(void) {
+  CTSingleLock slStats(&_csStats, TRUE);
+
+  MoveCounters();
+  memset(&_ssStats, 0, sizeof(_ssStats));
+
+  _llPeakMemory = _llLiveMemory;
+  _ssStats.llLiveMemory = _llLiveMemory;
+  _ssStats.llPeakMemory = _llPeakMemory;
+};
+
+#endif // _PATCHCONFIG_FIX_STREAMPAGING
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
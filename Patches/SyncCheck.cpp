@@ -0,0 +1,276 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+#include "../WorkerPool.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK && _PATCHCONFIG_GUID_MASKING
+
+// Checksum the world once and combine it with player GUIDs for each session
+INDEX ISyncCheck::_bCombine = TRUE;
+
+// Threads for checksumming the world for each session separately (0 = checksum on the main thread)
+// [Cecil] NOTE: Opt-in because it relies on ChecksumForSync() of every entity class not modifying anything
+INDEX ISyncCheck::_iThreads = 0;
+
+// Threads that checksum the world for each session
+static CWorkerPool _wpSessions;
+
+// TLS slot with the client that's being handled by the current worker thread (client + 1, 0 if none)
+// [Cecil] NOTE: IProcessPacket::_iHandlingClient is shared between all threads and __declspec(thread)
+// variables aren't set up on XP for DLLs that are loaded dynamically
+static DWORD _dwWorkerClient = TLS_OUT_OF_INDEXES;
+
+// Checksum job for one session
+struct SessionJob {
+  CSessionState *pses;
+  INDEX iSession;
+  ULONG *pulCRC;
+};
+
+static CStaticStackArray<SessionJob> _aSessionJobs;
+
+// Part of the world checksum that precedes a player GUID
+struct SyncSegment {
+  CPlayerEntity *penPlayer; // Player after the segment (NULL for the last one)
+  CPlayerBuffer *pplb; // Player buffer of that player
+  ULONG ulCRC; // Checksum of the segment from an empty register
+  ULONG ulShift; // Factor that moves any register past the segment
+};
+
+static CStaticStackArray<SyncSegment> _aSegments;
+
+// Current splitting pass (-1 = not splitting)
+static INDEX _iSplitPass = -1;
+static INDEX _iNextSegment = 0;
+
+// Register at the start of each segment for each pass (empty register and x^0)
+static const ULONG _aulSegmentStart[2] = { 0x00000000, 0x80000000 };
+
+// Multiply two polynomials modulo the CRC polynomial (in reflected bit order)
+static ULONG MultModP(ULONG ulA, ULONG ulB) {
+  // Reflected table entry for the highest bit is the polynomial itself
+  const ULONG ulPoly = crc_aulCRCTable[128];
+  ULONG ulProduct = 0;
+
+  for (ULONG ulBit = 0x80000000; ulBit != 0; ulBit >>= 1) {
+    if (ulA & ulBit) ulProduct ^= ulB;
+    ulB = (ulB & 1) ? (ulB >> 1) ^ ulPoly : (ulB >> 1);
+  }
+
+  return ulProduct;
+};
+
+// Get client that's currently being handled on this thread
+INDEX ISyncCheck::HandlingClient(void) {
+  if (_dwWorkerClient != TLS_OUT_OF_INDEXES) {
+    const INDEX iWorkerClient = (INDEX)(size_t)TlsGetValue(_dwWorkerClient);
+    if (iWorkerClient != 0) return iWorkerClient - 1;
+  }
+
+  return IProcessPacket::_iHandlingClient;
+};
+
+// Get player GUID that should be seen by some client
+void ISyncCheck::PlayerGUID(CPlayerBuffer *pplb, INDEX iClient, UBYTE *aubGUID) {
+  // Use GUID from the buffer for the current client
+  if (iClient == pplb->plb_iClient) {
+    memcpy(aubGUID, pplb->plb_pcCharacter.pc_aubGUID, sizeof(pplb->plb_pcCharacter.pc_aubGUID));
+
+  } else {
+    IPlayerMap::MaskGUID(pplb, aubGUID);
+  }
+};
+
+// End world checksum segment before player GUID, if splitting
+BOOL ISyncCheck::SplitAtPlayer(CPlayerEntity *pen, ULONG &ulCRC) {
+  if (_iSplitPass == -1) return FALSE;
+
+  if (_iSplitPass == 0) {
+    SyncSegment &seg = _aSegments.Push();
+    seg.penPlayer = pen;
+    seg.pplb = (pen != NULL) ? IPlayerMap::BufferFromEntity(pen) : NULL;
+    seg.ulCRC = ulCRC;
+    seg.ulShift = 0;
+
+  } else {
+    // Second pass goes through the same players
+    SyncSegment &seg = _aSegments[_iNextSegment++];
+    ASSERT(seg.penPlayer == pen);
+
+    // Register that started at x^0 has been moved by x^(8 * segment length)
+    seg.ulShift = ulCRC ^ seg.ulCRC;
+  }
+
+  // Start the next segment
+  ulCRC = _aulSegmentStart[_iSplitPass];
+  return TRUE;
+};
+
+// Checksum the whole world while splitting it into segments
+static void ChecksumPass(CSessionState &ses, INDEX iPass) {
+  _iSplitPass = iPass;
+  _iNextSegment = 0;
+
+  ULONG ulCRC = _aulSegmentStart[iPass];
+  ses.ChecksumForSync(ulCRC, ses.ses_iExtensiveSyncCheck);
+
+  // Last segment without a player
+  ISyncCheck::SplitAtPlayer(NULL, ulCRC);
+
+  _iSplitPass = -1;
+};
+
+// Combine world segments with player GUIDs for some session
+static ULONG CombineForSession(INDEX iSession) {
+  ULONG ulCRC;
+  CRC_Start(ulCRC);
+
+  for (INDEX iSegment = 0; iSegment < _aSegments.Count(); iSegment++) {
+    const SyncSegment &seg = _aSegments[iSegment];
+
+    // Same as adding all bytes of the segment to the current register
+    ulCRC = MultModP(seg.ulShift, ulCRC) ^ seg.ulCRC;
+
+    if (seg.penPlayer == NULL) continue;
+
+    // Same blocks as in CPlayerEntityPatch::P_ChecksumForSync()
+    UBYTE aubGUID[16];
+    ISyncCheck::PlayerGUID(seg.pplb, iSession, aubGUID);
+
+    CRC_AddBlock(ulCRC, aubGUID, sizeof(aubGUID));
+    CRC_AddBlock(ulCRC, seg.penPlayer->en_pcCharacter.pc_aubAppearance, sizeof(seg.penPlayer->en_pcCharacter.pc_aubAppearance));
+  }
+
+  CRC_Finish(ulCRC);
+  return ulCRC;
+};
+
+// Checksum the world for one session
+static ULONG ChecksumForSession(CSessionState &ses) {
+  ULONG ulCRC;
+  CRC_Start(ulCRC);
+  ses.ChecksumForSync(ulCRC, ses.ses_iExtensiveSyncCheck);
+  CRC_Finish(ulCRC);
+
+  return ulCRC;
+};
+
+// Checksum the world for one session on a worker thread
+static void ExecuteSessionJob(void *pData) {
+  SessionJob &job = *(SessionJob *)pData;
+
+  TlsSetValue(_dwWorkerClient, (void *)(size_t)(job.iSession + 1));
+
+  *job.pulCRC = ChecksumForSession(*job.pses);
+
+  TlsSetValue(_dwWorkerClient, NULL);
+};
+
+// Checksum the world for each session separately on worker threads
+static BOOL ChecksumInParallel(CSessionState &ses, CStaticArray<ULONG> &aulCRCs) {
+  CServer &srv = _pNetwork->ga_srvServer;
+  const INDEX ctThreads = Clamp(ISyncCheck::_iThreads, (INDEX)1, (INDEX)8);
+
+  // Workers cannot tell which client they're handling
+  if (_dwWorkerClient == TLS_OUT_OF_INDEXES) {
+    _dwWorkerClient = TlsAlloc();
+    if (_dwWorkerClient == TLS_OUT_OF_INDEXES) return FALSE;
+  }
+
+  // Restart with a different amount of threads
+  if (_wpSessions.wp_ahThreads.Count() != ctThreads) {
+    _wpSessions.Stop();
+    _wpSessions.Start(ctThreads);
+  }
+
+  // Prepare all jobs before queueing them
+  _aSessionJobs.PopAll();
+
+  for (INDEX iSession = 0; iSession < aulCRCs.Count(); iSession++) {
+    if (iSession > 0 && !srv.srv_assoSessions[iSession].sso_bActive) continue;
+
+    SessionJob &job = _aSessionJobs.Push();
+    job.pses = &ses;
+    job.iSession = iSession;
+    job.pulCRC = &aulCRCs[iSession];
+  }
+
+  for (INDEX iJob = 0; iJob < _aSessionJobs.Count(); iJob++) {
+    _wpSessions.AddJob(&ExecuteSessionJob, &_aSessionJobs[iJob]);
+  }
+
+  // Results are written in session order
+  _wpSessions.Wait();
+  return TRUE;
+};
+
+// Make world checksums for each active session on the server
+void ISyncCheck::ForSessions(CSessionState &ses, CStaticArray<ULONG> &aulCRCs) {
+  CServer &srv = _pNetwork->ga_srvServer;
+  const INDEX ctSessions = srv.srv_assoSessions.Count();
+
+  if (aulCRCs.Count() != ctSessions) {
+    aulCRCs.Clear();
+    aulCRCs.New(ctSessions);
+  }
+
+  // Nothing should be rebuilt during checksums
+  IPlayerMap::Prepare();
+
+  // Checksum the world for each session separately
+  if (!_bCombine) {
+    if (_iThreads > 0 && ChecksumInParallel(ses, aulCRCs)) return;
+
+    for (INDEX iSession = 0; iSession < ctSessions; iSession++) {
+      if (iSession > 0 && !srv.srv_assoSessions[iSession].sso_bActive) continue;
+
+      IProcessPacket::_iHandlingClient = iSession;
+      aulCRCs[iSession] = ChecksumForSession(ses);
+    }
+
+    IProcessPacket::_iHandlingClient = IProcessPacket::CLT_NONE;
+    return;
+  }
+
+  // Split the world checksum around player GUIDs
+  _aSegments.PopAll();
+  ChecksumPass(ses, 0);
+  ChecksumPass(ses, 1);
+
+  for (INDEX iSession = 0; iSession < ctSessions; iSession++) {
+    if (iSession > 0 && !srv.srv_assoSessions[iSession].sso_bActive) continue;
+
+    aulCRCs[iSession] = CombineForSession(iSession);
+  }
+};
+
+// Stop worker threads
+void ISyncCheck::Stop(void) {
+  _wpSessions.Stop();
+
+  if (_dwWorkerClient != TLS_OUT_OF_INDEXES) {
+    TlsFree(_dwWorkerClient);
+    _dwWorkerClient = TLS_OUT_OF_INDEXES;
+  }
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK && _PATCHCONFIG_GUID_MASKING
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,232 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+#include "UnpageStreams.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Demo is being played as a benchmark
+BOOL ITimeDemo::_bActive = FALSE;
+
+// Measurements of one simulated step
+struct TimeDemoStep {
+  DOUBLE dSimTime; // Time spent processing the game stream
+  DOUBLE dBlockTime; // Time spent in processed blocks
+  INDEX ctBlocks;
+  INDEX ctEntities; // Entities in the world after the step
+  INDEX ctAllocations; // Stream buffers allocated during the step
+};
+
+static CStaticStackArray<TimeDemoStep> _aSteps;
+
+// Blocks of the current step
+static DOUBLE _dBlockTime = 0.0;
+static INDEX _ctBlocks = 0;
+
+// Current time for measuring
+static inline DOUBLE BenchTime(void) {
+  return _pTimer->GetHighPrecisionTimer().GetSeconds();
+};
+
+// Amount of allocated stream buffers so far
+static INDEX AllocationCount(void) {
+#if _PATCHCONFIG_FIX_STREAMPAGING
+  IStreamStats::Stats ss;
+  IStreamStats::Get(ss);
+  return ss.ctAllocations;
+#else
+  return 0;
+#endif
+};
+
+// Start measuring one game stream block
+ITimeDemo::CBlockTimer::CBlockTimer() {
+  bt_dStart = (_bActive ? BenchTime() : -1.0);
+};
+
+// Stop measuring one game stream block
+ITimeDemo::CBlockTimer::~CBlockTimer() {
+  if (bt_dStart < 0.0) return;
+
+  _dBlockTime += BenchTime() - bt_dStart;
+  _ctBlocks++;
+};
+
+// Sort measured values in ascending order
+static int CompareValues(const void *pA, const void *pB) {
+  const DOUBLE dA = *(const DOUBLE *)pA;
+  const DOUBLE dB = *(const DOUBLE *)pB;
+
+  if (dA < dB) return -1;
+  if (dA > dB) return +1;
+  return 0;
+};
+
+// Value at some percentile of sorted values
+static DOUBLE Percentile(const CStaticStackArray<DOUBLE> &aValues, DOUBLE dPercent) {
+  const INDEX ct = aValues.Count();
+  if (ct == 0) return 0.0;
+
+  const INDEX i = Clamp(INDEX(ceil(dPercent / 100.0 * ct)) - 1, (INDEX)0, ct - 1);
+  return aValues[i];
+};
+
+// Write percentiles of some measurement into the report
+static void WritePercentiles(CTStream &strm, const char *strName, CStaticStackArray<DOUBLE> &aValues, BOOL bLast) {
+  const INDEX ct = aValues.Count();
+
+  if (ct > 0) {
+    qsort(&aValues[0], ct, sizeof(DOUBLE), &CompareValues);
+  }
+
+  DOUBLE dSum = 0.0;
+
+  for (INDEX i = 0; i < ct; i++) {
+    dSum += aValues[i];
+  }
+
+  strm.FPrintF_t("  \"%s\": { \"mean\": %.9f, \"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f, \"max\": %.9f }%s\n",
+    strName, (ct > 0 ? dSum / ct : 0.0), Percentile(aValues, 50.0), Percentile(aValues, 90.0),
+    Percentile(aValues, 99.0), (ct > 0 ? aValues[ct - 1] : 0.0), (bLast ? "" : ","));
+};
+
+// Write results of the benchmark into a JSON file
+static void WriteReport(const CTString &strDemo, const CTString &strReport, DOUBLE dTotal, FLOAT fDemoTime) {
+  const INDEX ctSteps = _aSteps.Count();
+
+  CStaticStackArray<DOUBLE> adSim, adBlocks, adEntities, adAllocs;
+  INDEX ctBlocks = 0;
+  INDEX ctAllocs = 0;
+
+  for (INDEX i = 0; i < ctSteps; i++) {
+    const TimeDemoStep &step = _aSteps[i];
+    adSim.Push() = step.dSimTime;
+    adEntities.Push() = step.ctEntities;
+    adAllocs.Push() = step.ctAllocations;
+    ctBlocks += step.ctBlocks;
+    ctAllocs += step.ctAllocations;
+
+    if (step.ctBlocks > 0) {
+      adBlocks.Push() = step.dBlockTime / step.ctBlocks;
+    }
+  }
+
+  CTFileStream strm;
+  strm.Create_t(CTFileName(strReport));
+
+  strm.FPrintF_t("{\n  \"demo\": \"%s\",\n", strDemo.str_String);
+  strm.FPrintF_t("  \"ticks\": %d,\n  \"blocks\": %d,\n", ctSteps, ctBlocks);
+  strm.FPrintF_t("  \"demo_seconds\": %.3f,\n  \"real_seconds\": %.6f,\n", fDemoTime, dTotal);
+  strm.FPrintF_t("  \"ticks_per_second\": %.3f,\n", ctSteps / ClampDn(dTotal, 1e-6));
+  strm.FPrintF_t("  \"allocations\": %d,\n", ctAllocs);
+
+  WritePercentiles(strm, "tick_seconds", adSim, FALSE);
+  WritePercentiles(strm, "block_seconds", adBlocks, FALSE);
+  WritePercentiles(strm, "entities", adEntities, FALSE);
+  WritePercentiles(strm, "allocations_per_tick", adAllocs, TRUE);
+
+  strm.FPrintF_t("}\n");
+  strm.Close();
+};
+
+// Play a demo as fast as possible and report simulation costs
+void ITimeDemo::Run(void *pArgs) {
+  CTString strDemo = *NEXTARGUMENT(CTString *);
+  CTString strReport = *NEXTARGUMENT(CTString *);
+
+  if (strReport == "") {
+    strReport = "Temp\\TimeDemo.json";
+  }
+
+  CNetworkLibrary &nl = *_pNetwork;
+  CSessionState &ses = nl.ga_sesSessionState;
+
+  if (nl.IsServer() || nl.ga_bDemoPlay || nl.ga_bDemoRec) {
+    CPutString(TRANS("Stop the current game before running a timedemo!\n"));
+    return;
+  }
+
+  try {
+    nl.StartDemoPlay_t(CTFileName(strDemo));
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Cannot start timedemo:\n%s\n"), strError);
+    return;
+  }
+
+  CPrintF(TRANS("Running timedemo '%s'...\n"), strDemo.str_String);
+
+  _aSteps.PopAll();
+  _bActive = TRUE;
+
+  const TIME tmTick = _pTimer->TickQuantum;
+  const DOUBLE dStart = BenchTime();
+
+  // Simulate ticks one after another without rendering or mixing sounds in between
+  try {
+    CTSingleLock slNetwork(&nl.ga_csNetwork, TRUE);
+
+    while (nl.ga_bDemoPlay && !nl.IsDemoPlayFinished()) {
+      // Don't wait through pauses between recorded sequences
+      nl.ga_fDemoTimer = Max(nl.ga_fDemoTimer + tmTick, FLOAT(ses.ses_tmLastDemoSequence));
+
+      _dBlockTime = 0.0;
+      _ctBlocks = 0;
+
+      const INDEX ctAllocsBefore = AllocationCount();
+      const DOUBLE dStepStart = BenchTime();
+
+      ses.ProcessGameStream();
+
+      TimeDemoStep &step = _aSteps.Push();
+      step.dSimTime = BenchTime() - dStepStart;
+      step.dBlockTime = _dBlockTime;
+      step.ctBlocks = _ctBlocks;
+      step.ctEntities = nl.ga_World.wo_cenEntities.Count();
+      step.ctAllocations = AllocationCount() - ctAllocsBefore;
+    }
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Timedemo has been interrupted:\n%s\n"), strError);
+  }
+
+  const DOUBLE dTotal = BenchTime() - dStart;
+  const FLOAT fDemoTime = nl.ga_fDemoTimer;
+  _bActive = FALSE;
+
+  nl.StopGame();
+
+  CPrintF(TRANS("Timedemo: %d ticks in %.3fs (%.1f ticks/s)\n"),
+    _aSteps.Count(), dTotal, _aSteps.Count() / ClampDn(dTotal, 1e-6));
+
+  try {
+    WriteReport(strDemo, strReport, dTotal, fDemoTime);
+    CPrintF(TRANS("Timedemo report has been written into '%s'\n"), strReport.str_String);
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Cannot write timedemo report:\n%s\n"), strError);
+  }
+
+  _aSteps.PopAll();
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
@@ -0,0 +1,227 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#if _PATCHCONFIG_ENGINEPATCHES
+
+#include "Network.h"
+
+#if _PATCHCONFIG_EXTEND_NETWORK
+
+// Count network messages of each type
+INDEX ITrafficStats::_bEnabled = FALSE;
+
+// How often to roll up counted messages (in seconds)
+FLOAT ITrafficStats::_fRollupInterval = 5.0f;
+
+// Amount of message types
+static const INDEX _ctTypes = 256;
+
+// Message size buckets (up to 16 bytes, up to 32 bytes, ..., over 16 KB)
+static const INDEX _ctBuckets = 12;
+
+// Names of traffic directions
+static const char *_astrDirNames[ITrafficStats::ETD_MAX] = {
+  "received", // ETD_RECEIVED
+  "stream",   // ETD_STREAM
+  "sent",     // ETD_SENT
+};
+
+// Messages counted since the last rollup (accumulated from any thread)
+struct TypeCounters {
+  LONG lCount;
+  LONG lBytes;
+  LONG alBuckets[_ctBuckets];
+};
+
+// Rolled up messages
+struct TypeTotals {
+  __int64 llCount;
+  __int64 llBytes;
+  __int64 allBuckets[_ctBuckets];
+  DOUBLE dRate; // Bytes per second during the last rollup interval
+};
+
+static TypeCounters _aCurrent[ITrafficStats::ETD_MAX][_ctTypes];
+static TypeTotals _aTotals[ITrafficStats::ETD_MAX][_ctTypes];
+
+// Time of the last rollup
+static DOUBLE _dLastRollup = -1.0;
+
+// Current time for rollups
+static inline DOUBLE TrafficTime(void) {
+  return _pTimer->GetHighPrecisionTimer().GetSeconds();
+};
+
+// Get size bucket of a message
+static inline INDEX SizeBucket(SLONG slSize) {
+  INDEX iBucket = 0;
+
+  for (SLONG slLimit = 16; iBucket < _ctBuckets - 1 && slSize > slLimit; slLimit <<= 1) {
+    iBucket++;
+  }
+
+  return iBucket;
+};
+
+// Count one message
+void ITrafficStats::Count(EDirection eDir, const CNetworkMessage &nmMessage) {
+  if (!_bEnabled) return;
+
+  const INDEX iType = UBYTE(nmMessage.GetType());
+  const SLONG slSize = nmMessage.nm_slSize;
+
+  TypeCounters &tc = _aCurrent[eDir][iType];
+  InterlockedIncrement(&tc.lCount);
+  InterlockedExchangeAdd(&tc.lBytes, slSize);
+  InterlockedIncrement(&tc.alBuckets[SizeBucket(slSize)]);
+};
+
+// Move counted messages into totals
+static void Rollup(void) {
+  const DOUBLE dNow = TrafficTime();
+  const DOUBLE dWindow = (_dLastRollup < 0.0) ? 0.0 : dNow - _dLastRollup;
+  _dLastRollup = dNow;
+
+  for (INDEX iDir = 0; iDir < ITrafficStats::ETD_MAX; iDir++) {
+    for (INDEX iType = 0; iType < _ctTypes; iType++) {
+      TypeCounters &tc = _aCurrent[iDir][iType];
+      TypeTotals &tt = _aTotals[iDir][iType];
+
+      const LONG lBytes = InterlockedExchange(&tc.lBytes, 0);
+      tt.llCount += InterlockedExchange(&tc.lCount, 0);
+      tt.llBytes += lBytes;
+
+      for (INDEX iBucket = 0; iBucket < _ctBuckets; iBucket++) {
+        tt.allBuckets[iBucket] += InterlockedExchange(&tc.alBuckets[iBucket], 0);
+      }
+
+      tt.dRate = (dWindow > 0.0) ? lBytes / dWindow : 0.0;
+    }
+  }
+};
+
+// Roll up counted messages periodically
+void ITrafficStats::Update(void) {
+  if (!_bEnabled) return;
+
+  if (_dLastRollup >= 0.0 && TrafficTime() - _dLastRollup < ClampDn(_fRollupInterval, 0.1f)) return;
+
+  Rollup();
+};
+
+// Sort message types by sent bytes in descending order
+static const TypeTotals *_aSortTotals = NULL;
+
+static int CompareTypes(const void *pA, const void *pB) {
+  const __int64 llA = _aSortTotals[*(const INDEX *)pA].llBytes;
+  const __int64 llB = _aSortTotals[*(const INDEX *)pB].llBytes;
+
+  if (llA > llB) return -1;
+  if (llA < llB) return +1;
+  return 0;
+};
+
+// Print counted messages
+void ITrafficStats::Print(void) {
+  Rollup();
+
+  for (INDEX iDir = 0; iDir < ETD_MAX; iDir++) {
+    INDEX aiTypes[_ctTypes];
+    INDEX ctUsed = 0;
+    __int64 llDirBytes = 0;
+
+    for (INDEX iType = 0; iType < _ctTypes; iType++) {
+      if (_aTotals[iDir][iType].llCount == 0) continue;
+
+      aiTypes[ctUsed++] = iType;
+      llDirBytes += _aTotals[iDir][iType].llBytes;
+    }
+
+    CPrintF(TRANS("Traffic (%s): %I64d bytes\n"), _astrDirNames[iDir], llDirBytes);
+
+    _aSortTotals = _aTotals[iDir];
+    qsort(aiTypes, ctUsed, sizeof(INDEX), &CompareTypes);
+
+    for (INDEX i = 0; i < ctUsed; i++) {
+      const TypeTotals &tt = _aTotals[iDir][aiTypes[i]];
+
+      CPrintF("  type %3d: %8I64d msgs | %10I64d bytes | %7.1f avg | %9.1f B/s\n",
+        aiTypes[i], tt.llCount, tt.llBytes, DOUBLE(tt.llBytes) / tt.llCount, tt.dRate);
+    }
+  }
+};
+
+// Dump counted messages into a CSV file
+void ITrafficStats::Dump(void *pArgs) {
+  CTString strFile = *NEXTARGUMENT(CTString *);
+
+  if (strFile == "") {
+    strFile = "Temp\\TrafficStats.csv";
+  }
+
+  Rollup();
+
+  try {
+    CTFileStream strm;
+    strm.Create_t(CTFileName(strFile));
+
+    strm.FPrintF_t("direction,type,count,bytes,rate");
+
+    for (INDEX iBucket = 0; iBucket < _ctBuckets; iBucket++) {
+      if (iBucket == _ctBuckets - 1) {
+        strm.FPrintF_t(",over_%d", 16 << (iBucket - 1));
+      } else {
+        strm.FPrintF_t(",upto_%d", 16 << iBucket);
+      }
+    }
+
+    strm.FPrintF_t("\n");
+
+    for (INDEX iDir = 0; iDir < ETD_MAX; iDir++) {
+      for (INDEX iType = 0; iType < _ctTypes; iType++) {
+        const TypeTotals &tt = _aTotals[iDir][iType];
+        if (tt.llCount == 0) continue;
+
+        strm.FPrintF_t("%s,%d,%I64d,%I64d,%.1f", _astrDirNames[iDir], iType, tt.llCount, tt.llBytes, tt.dRate);
+
+        for (INDEX iBucket = 0; iBucket < _ctBuckets; iBucket++) {
+          strm.FPrintF_t(",%I64d", tt.allBuckets[iBucket]);
+        }
+
+        strm.FPrintF_t("\n");
+      }
+    }
+
+    strm.Close();
+    CPrintF(TRANS("Dumped traffic statistics into '%s'\n"), strFile.str_String);
+
+  } catch (char *strError) {
+    CPrintF(TRANS("Cannot dump traffic statistics:\n%s\n"), strError);
+  }
+};
+
+// Reset all counters
+void ITrafficStats::Reset(void) {
+  Rollup();
+
+  memset(_aTotals, 0, sizeof(_aTotals));
+  _dLastRollup = -1.0;
+};
+
+#endif // _PATCHCONFIG_EXTEND_NETWORK
+
+#endif // _PATCHCONFIG_ENGINEPATCHES
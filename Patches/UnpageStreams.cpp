@@ -19,8 +19,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "UnpageStreams.h"
 #include "FileSystem.h"
+#include "../WorkerPool.h"
 
 #include <Engine/Base/Unzip.h>
+#include <Engine/Network/Compression.h>
 
 #include <CoreLib/Base/Unzip.h>
 #include <CoreLib/Interfaces/ResourceFunctions.h>
@@ -36,30 +38,221 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <Engine/Templates/NameTable.h>
 #include <Engine/Templates/NameTable.cpp>
 
+// Stream buffers are allocated normally and hold entire contents
+BOOL _bUnpagedStreams = FALSE;
+
 #undef CNameTableSlot_TYPE
 #undef CNameTable_TYPE
 #undef TYPE
 
+// Define CNameTable_CRemLevel
+#define TYPE CRemLevel
+#define CNameTable_TYPE CNameTable_CRemLevel
+#define CNameTableSlot_TYPE CNameTableSlot_CRemLevel
+
+#include <Engine/Templates/NameTable.h>
+#include <Engine/Templates/NameTable.cpp>
+
+#undef CNameTableSlot_TYPE
+#undef CNameTable_TYPE
+#undef TYPE
+
+// Remembered levels by their filenames
+static CNameTable_CRemLevel &RemLevelTable(void) {
+  static CNameTable_CRemLevel _ntRemLevels;
+  static BOOL _bInitialized = FALSE;
+
+  if (!_bInitialized) {
+    _ntRemLevels.SetAllocationParameters(50, 3, 3);
+    _bInitialized = TRUE;
+  }
+
+  return _ntRemLevels;
+};
+
+// Missing from older SDKs
+#ifndef MEM_LARGE_PAGE
+  #define MEM_LARGE_PAGE 0x20000000
+#endif
+
+// Buffers that are currently allocated with large pages
+static LONG _ctLargePageBuffers = 0;
+
+// GetLargePageMinimum() from kernel32
+typedef SIZE_T (WINAPI *CGetLargePageMinimumFunc)(void);
+
+// Get minimum size of a large page (0 if they can't be used)
+static SIZE_T LargePageSize(void) {
+  static SIZE_T _ulLargePage = (SIZE_T)-1;
+
+  if (_ulLargePage != (SIZE_T)-1) return _ulLargePage;
+  _ulLargePage = 0;
+
+  // Large pages require a privilege for locking memory
+  HANDLE hToken;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken)) return 0;
+
+  TOKEN_PRIVILEGES tp;
+  tp.PrivilegeCount = 1;
+  tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+  BOOL bEnabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &tp.Privileges[0].Luid)
+    && AdjustTokenPrivileges(hToken, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+
+  CloseHandle(hToken);
+
+  if (bEnabled) {
+    // Not available on Windows XP
+    CGetLargePageMinimumFunc pGetLargePageMinimum = (CGetLargePageMinimumFunc)GetProcAddress(
+      GetModuleHandleA("kernel32.dll"), "GetLargePageMinimum");
+
+    if (pGetLargePageMinimum != NULL) {
+      _ulLargePage = pGetLargePageMinimum();
+    }
+
+  } else {
+    CPutString(LOCALIZE("Large pages for stream buffers are unavailable without the \"Lock pages in memory\" privilege\n"));
+  }
+
+  return _ulLargePage;
+};
+
+// Try to allocate a buffer with large pages
+static UBYTE *AllocLargePages(ULONG ulSize) {
+  const SIZE_T ulPage = LargePageSize();
+  UBYTE *pub = NULL;
+
+  if (ulPage != 0) {
+    const SIZE_T ulRounded = (ulSize + ulPage - 1) / ulPage * ulPage;
+    pub = (UBYTE *)VirtualAlloc(NULL, ulRounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGE, PAGE_READWRITE);
+  }
+
+  IStreamStats::LargePages(pub != NULL);
+
+  if (pub != NULL) {
+    InterlockedIncrement(&_ctLargePageBuffers);
+  }
+
+  return pub;
+};
+
+// Check if a buffer has been allocated with large pages
+static BOOL IsLargePageBuffer(UBYTE *pub) {
+  // None are allocated
+  if (_ctLargePageBuffers <= 0) return FALSE;
+
+  // Large page buffers start their own allocations, unlike heap blocks that always have a header in front of them
+  MEMORY_BASIC_INFORMATION mbi;
+  if (VirtualQuery(pub, &mbi, sizeof(mbi)) == 0) return FALSE;
+
+  return mbi.AllocationBase == pub && mbi.Type == MEM_PRIVATE;
+};
+
+// Free a buffer if it has been allocated with large pages
+static BOOL FreeLargePages(UBYTE *pub) {
+  if (!IsLargePageBuffer(pub)) return FALSE;
+
+  InterlockedDecrement(&_ctLargePageBuffers);
+  VirtualFree(pub, 0, MEM_RELEASE);
+  return TRUE;
+};
+
 // Allocate memory normally
 void CUnpageStreamPatch::P_AllocVirtualMemory(ULONG ulBytesToAllocate)
 {
+  const DOUBLE dStartTime = IStreamStats::Now();
+
   // Allocate at least 128 bytes and align them to blocks of 64
   ULONG ulAlloc = (ulBytesToAllocate / 64 + 2) * 64;
 
-  strm_pubBufferBegin = (UBYTE *)calloc(ulAlloc, 1);
+  // [Cecil] Try using large pages for big buffers with actual contents, since memory
+  // reserved for writing would be committed right away instead of being grown into
+  const ULONG ulLargeThreshold = _EnginePatches._iLargePageThreshold * 1024;
+  UBYTE *pubLarge = NULL;
+
+  if (ulLargeThreshold > 0 && ulAlloc >= ulLargeThreshold && ulBytesToAllocate != _EnginePatches._ulMaxWriteMemory) {
+    pubLarge = AllocLargePages(ulAlloc);
+  }
+
+  // Committed pages are already zeroed
+  strm_pubBufferBegin = (pubLarge != NULL) ? pubLarge : (UBYTE *)calloc(ulAlloc, 1);
   strm_pubBufferEnd = strm_pubBufferBegin + ulAlloc;
 
   strm_pubCurrentPos = strm_pubBufferBegin;
   strm_pubMaxPos = strm_pubBufferBegin;
 
   strm_pubEOF = strm_pubBufferBegin + ulBytesToAllocate;
+
+  // [Cecil] Count allocated memory
+  IStreamStats::Allocated(this, ulAlloc, pubLarge != NULL, dStartTime);
+};
+
+// Take over contents in a buffer from malloc() that's padded in the same way as in P_AllocVirtualMemory()
+void CUnpageStreamPatch::AdoptBuffer(UBYTE *pubBuffer, ULONG ulBytes)
+{
+  ASSERT(strm_pubBufferBegin == NULL);
+  const DOUBLE dStartTime = IStreamStats::Now();
+
+  const ULONG ulAlloc = (ulBytes / 64 + 2) * 64;
+
+  strm_pubBufferBegin = pubBuffer;
+  strm_pubBufferEnd = strm_pubBufferBegin + ulAlloc;
+
+  strm_pubCurrentPos = strm_pubBufferBegin;
+  strm_pubMaxPos = strm_pubBufferBegin;
+
+  strm_pubEOF = strm_pubBufferBegin + ulBytes;
+
+  IStreamStats::Allocated(this, ulAlloc, FALSE, dStartTime);
+};
+
+// Read contents in a buffer that's owned by the decompressed entry cache and padded in the same way
+void CUnpageStreamPatch::ShareBuffer(UBYTE *pubBuffer, ULONG ulBytes)
+{
+  ASSERT(strm_pubBufferBegin == NULL);
+
+  // Not counted as a stream buffer, since it's already counted by the cache
+  strm_pubBufferBegin = pubBuffer;
+  strm_pubBufferEnd = strm_pubBufferBegin + (ulBytes / 64 + 2) * 64;
+
+  strm_pubCurrentPos = strm_pubBufferBegin;
+  strm_pubMaxPos = strm_pubBufferBegin;
+
+  strm_pubEOF = strm_pubBufferBegin + ulBytes;
+};
+
+// Take contents away from a stream, so they can be freed with free() later (NULL if they can't be)
+UBYTE *CUnpageStreamPatch::DetachBuffer(void)
+{
+  // Only memory streams are expected here, which are never shared or decompressed in windows
+  if (!_bUnpagedStreams || strm_pubBufferBegin == NULL || IsLargePageBuffer(strm_pubBufferBegin)) return NULL;
+
+  UBYTE *pubBuffer = strm_pubBufferBegin;
+  IStreamStats::Freed(this);
+
+  strm_pubBufferBegin = NULL;
+  strm_pubBufferEnd   = NULL;
+  strm_pubCurrentPos  = NULL;
+  strm_pubEOF         = NULL;
+  strm_pubMaxPos      = NULL;
+
+  return pubBuffer;
 };
 
 // Free memory normally
 void CUnpageStreamPatch::P_FreeBuffer(void)
 {
   if (strm_pubBufferBegin != NULL) {
-    free(strm_pubBufferBegin);
+    // [Cecil] Hand shared contents back to the cache or free them
+    if (!IZipCache::Release(strm_pubBufferBegin)) {
+      // [Cecil] Count freed memory
+      IStreamStats::Freed(this);
+
+      if (!IZipWindow::Free(strm_pubBufferBegin) && !IDemoBlocks::Free(strm_pubBufferBegin)
+       && !FreeLargePages(strm_pubBufferBegin)) {
+        free(strm_pubBufferBegin);
+      }
+    }
 
     strm_pubBufferBegin = NULL;
     strm_pubBufferEnd   = NULL;
@@ -72,12 +265,17 @@ void CUnpageStreamPatch::P_FreeBuffer(void)
 // Create a new file
 void CFileStreamPatch::P_Create(const CTFileName &fnFileName, CTStream::CreateMode cm)
 {
+  const DOUBLE dStartTime = IStreamStats::Now();
+
   CTFileName fnmFullFileName;
   INDEX iFile = ExpandFilePath(EFP_WRITE, fnFileName, fnmFullFileName);
 
   ASSERT(fnFileName.Length() > 0);
   ASSERT(fstrm_pFile == NULL);
 
+  // [Cecil] Don't let anything open old contents of the file
+  IFileReads::Drop(fnmFullFileName);
+
   fstrm_pFile = fopen(fnmFullFileName, "wb+");
 
   if (fstrm_pFile == NULL) {
@@ -89,6 +287,8 @@ void CFileStreamPatch::P_Create(const CTFileName &fnFileName, CTStream::CreateMo
 
   strm_strStreamDescription = fnFileName;
   fstrm_bReadOnly = FALSE;
+
+  IStreamStats::Opened(this, IStreamStats::ESL_CREATE, 0, 0, dStartTime);
 };
 
 // Open a file
@@ -97,6 +297,12 @@ void CFileStreamPatch::P_Open(const CTFileName &fnFileName, CTStream::OpenMode o
   ASSERT(fnFileName.Length() > 0);
   ASSERT(fstrm_pFile == NULL && fstrm_iZipHandle == -1);
 
+  // [Cecil] Gather statistics about the opening
+  const DOUBLE dStartTime = IStreamStats::Now();
+  IStreamStats::EStreamLayer eLayer = IStreamStats::ESL_UPDATE;
+  SLONG slRead = 0;
+  SLONG slDecompressed = 0;
+
   const ULONG ulOpenFlags = (om == OM_READ) ? EFP_READ : EFP_WRITE;
   CTFileName fnmFullFileName;
   INDEX iFile = ExpandFilePath(ulOpenFlags, fnFileName, fnmFullFileName);
@@ -124,16 +330,45 @@ void CFileStreamPatch::P_Open(const CTFileName &fnFileName, CTStream::OpenMode o
     fstrm_pFile = NULL;
 
     if (iFile == EFP_MODZIP || iFile == EFP_BASEZIP) {
-      // Retrieve ZIP handle to the file
-      fstrm_iZipHandle = IUnzip::Open_t(fnmFullFileName);
-
-      // Allocate as much memory as the decompressed file size
-      const SLONG slFileSize = IUnzip::GetSize(fstrm_iZipHandle);
-
-      P_AllocVirtualMemory(slFileSize);
-
-      // Read file contents into the stream
-      IUnzip::ReadBlock_t(fstrm_iZipHandle, strm_pubBufferBegin, 0, slFileSize);
+      // [Cecil] Reuse contents of an entry that has already been decompressed or is being decompressed in the background
+      if (IZipCache::Open(*this, fnmFullFileName, iFile)) {
+        fstrm_iZipHandle = ZIP_HANDLE_CACHED;
+        eLayer = IStreamStats::ESL_CACHE;
+
+      } else {
+        // [Cecil] Don't access ZIP files at the same time as background decompression
+        CTSingleLock slUnzip(&_csUnzip, TRUE);
+
+        // Retrieve ZIP handle to the file
+        fstrm_iZipHandle = IUnzip::Open_t(fnmFullFileName);
+
+        const SLONG slFileSize = IUnzip::GetSize(fstrm_iZipHandle);
+        eLayer = (iFile == EFP_MODZIP ? IStreamStats::ESL_MODZIP : IStreamStats::ESL_BASEZIP);
+        slDecompressed = slFileSize;
+
+        // [Cecil] Decompress big entries gradually as they're being read
+        if (IZipWindow::Start(*this, fstrm_iZipHandle, slFileSize)) {
+          slDecompressed = 0;
+
+        // [Cecil] Decompress it into the cache to reuse it next time and read it from there
+        } else if (IZipCache::Add_t(*this, fnmFullFileName, iFile, fstrm_iZipHandle, slFileSize)) {
+          IUnzip::Close(fstrm_iZipHandle);
+          fstrm_iZipHandle = ZIP_HANDLE_CACHED;
+
+        } else {
+          // Allocate as much memory as the decompressed file size
+          P_AllocVirtualMemory(slFileSize);
+
+          // Read file contents into the stream
+          IUnzip::ReadBlock_t(fstrm_iZipHandle, strm_pubBufferBegin, 0, slFileSize);
+        }
+      }
+
+    // [Cecil] Reuse contents that have been read in the background
+    } else if (iFile == EFP_FILE && IFileReads::Open(*this, fnmFullFileName)) {
+      fstrm_iZipHandle = ZIP_HANDLE_CACHED;
+      eLayer = IStreamStats::ESL_FILE;
+      slRead = strm_pubEOF - strm_pubBufferBegin;
 
     } else if (iFile == EFP_FILE) {
       // Open file for reading
@@ -149,6 +384,9 @@ void CFileStreamPatch::P_Open(const CTFileName &fnFileName, CTStream::OpenMode o
       // Read file contents into the stream
       fread(strm_pubBufferBegin, slFileSize, 1, fstrm_pFile);
 
+      eLayer = IStreamStats::ESL_FILE;
+      slRead = slFileSize;
+
     } else {
       Throw_t(LOCALIZE("Cannot open file `%s' (%s)"), fnmFullFileName.str_String, LOCALIZE("File not found"));
     }
@@ -156,6 +394,9 @@ void CFileStreamPatch::P_Open(const CTFileName &fnFileName, CTStream::OpenMode o
     fstrm_bReadOnly = TRUE;
 
   } else if (om == OM_WRITE) {
+    // [Cecil] Don't let anything open old contents of the file
+    IFileReads::Drop(fnmFullFileName);
+
     // Open file for updating
     fstrm_pFile = fopen(fnmFullFileName, "rb+");
     fstrm_bReadOnly = FALSE;
@@ -172,6 +413,13 @@ void CFileStreamPatch::P_Open(const CTFileName &fnFileName, CTStream::OpenMode o
   }
 
   strm_strStreamDescription = fnmFullFileName;
+
+  // [Cecil] Demos may be recorded in compressed blocks
+  if (om == OM_READ && iFile == EFP_FILE && _pNetwork != NULL && (CTStream *)this == &_pNetwork->ga_strmDemoPlay) {
+    IDemoBlocks::Unpack(*this);
+  }
+
+  IStreamStats::Opened(this, eLayer, slRead, slDecompressed, dStartTime);
 };
 
 // Close opened file
@@ -182,13 +430,23 @@ void CFileStreamPatch::P_Close(void)
     return;
   }
 
+  // [Cecil] Gather statistics about the closing
+  const DOUBLE dStartTime = IStreamStats::Now();
+  SLONG slWritten = 0;
+
   strm_strStreamDescription = "";
 
   if (fstrm_pFile != NULL) {
+    // [Cecil] Finish writing a demo that has been written in blocks
+    if (!fstrm_bReadOnly) {
+      IDemoBlocks::Finish(*this);
+    }
+
     // Flush written data back into the file
     if (!fstrm_bReadOnly) {
       fseek(fstrm_pFile, 0, SEEK_SET);
-      fwrite(strm_pubBufferBegin, GetStreamSize(), 1, fstrm_pFile);
+      slWritten = GetStreamSize();
+      fwrite(strm_pubBufferBegin, slWritten, 1, fstrm_pFile);
       fflush(fstrm_pFile);
     }
 
@@ -196,9 +454,14 @@ void CFileStreamPatch::P_Close(void)
     fstrm_pFile = NULL;
 
   } else if (fstrm_iZipHandle >= 0) {
+    CTSingleLock slUnzip(&_csUnzip, TRUE);
     IUnzip::Close(fstrm_iZipHandle);
 
     fstrm_iZipHandle = -1;
+
+  // [Cecil] Opened from the cache without a handle
+  } else if (fstrm_iZipHandle == ZIP_HANDLE_CACHED) {
+    fstrm_iZipHandle = -1;
   }
 
   // Clear allocated memory
@@ -209,32 +472,266 @@ void CFileStreamPatch::P_Close(void)
   strm_ntDictionary.Clear();
   strm_afnmDictionary.Clear();
   strm_slDictionaryPos = 0;
+
+  IStreamStats::Closed(slWritten, dStartTime);
 };
 
+// Thread for writing remembered levels on disk
+static CWorkerPool _wpSpill;
+
 // Constructor
-CRemLevel::CRemLevel(void) {
+CRemLevel::CRemLevel(void) : rl_pubCompressed(NULL), rl_slCompressed(0), rl_slSize(0), rl_pSpill(NULL) {
   strm_strStreamDescription = "dynamic memory stream";
 
   // Allocate enough memory for writing
-  P_AllocVirtualMemory(_EnginePatches._ulMaxWriteMemory);
+  AllocBuffer(_EnginePatches._ulMaxWriteMemory);
 };
 
 // Destructor
 CRemLevel::~CRemLevel(void) {
+  // Remove from the lookup table
+  CNameTable_CRemLevel &nt = RemLevelTable();
+
+  if (nt.Find(rl_strFileName) == this) {
+    nt.Remove(this);
+  }
+
   // Clear allocated memory
   P_FreeBuffer();
+
+  if (rl_pubCompressed != NULL) {
+    IStreamStats::BufferFreed(rl_pubCompressed);
+    free(rl_pubCompressed);
+  }
+
+  // Get rid of the temporary file once it's no longer being written
+  if (rl_pSpill != NULL) {
+    _wpSpill.Wait();
+    remove(rl_pSpill->fnmFile.str_String);
+
+    if (rl_pSpill->pubData != NULL) {
+      IStreamStats::BufferFreed(rl_pSpill->pubData);
+      free(rl_pSpill->pubData);
+    }
+
+    delete rl_pSpill;
+  }
+};
+
+// Allocate stream buffer for session state
+void CRemLevel::AllocBuffer(ULONG ulSize) {
+  P_AllocVirtualMemory(ulSize);
+  IStreamStats::SetOwner(this, IStreamStats::EBO_REMLEVEL);
+};
+
+// Compress written session state and free the stream buffer
+void CRemLevel::Compress(void) {
+  ASSERT(rl_pubCompressed == NULL);
+  rl_slSize = strm_pubMaxPos - strm_pubBufferBegin;
+
+  CLZCompressor comp;
+  SLONG slPacked = comp.NeededDestinationSize(rl_slSize);
+  UBYTE *pubPacked = (UBYTE *)malloc(slPacked);
+
+  // Keep it uncompressed if it doesn't pay off
+  if (!comp.Pack(strm_pubBufferBegin, rl_slSize, pubPacked, slPacked) || slPacked >= rl_slSize) {
+    free(pubPacked);
+    return;
+  }
+
+  // Shrink to the compressed size and get rid of the huge write buffer
+  rl_pubCompressed = (UBYTE *)realloc(pubPacked, slPacked);
+  rl_slCompressed = slPacked;
+
+  IStreamStats::BufferAllocated(rl_pubCompressed, rl_slCompressed, IStreamStats::EBO_REMLEVEL, rl_strFileName);
+
+  P_FreeBuffer();
+};
+
+// Restore the stream buffer from compressed session state
+void CRemLevel::Decompress(void) {
+  // Not compressed
+  if (rl_pubCompressed == NULL) return;
+
+  AllocBuffer(rl_slSize);
+
+  CLZCompressor comp;
+  SLONG slUnpacked = rl_slSize;
+
+  if (!comp.Unpack(rl_pubCompressed, rl_slCompressed, strm_pubBufferBegin, slUnpacked) || slUnpacked != rl_slSize) {
+    ThrowF_t(LOCALIZE("Cannot decompress remembered level '%s'"), rl_strFileName.str_String);
+  }
+
+  strm_pubMaxPos = strm_pubBufferBegin + rl_slSize;
+
+  IStreamStats::BufferFreed(rl_pubCompressed);
+  free(rl_pubCompressed);
+  rl_pubCompressed = NULL;
+  rl_slCompressed = 0;
+};
+
+// Write session state into a temporary file
+static void WriteSpill(void *pData) {
+  RemLevelSpill &spill = *(RemLevelSpill *)pData;
+
+  FILE *pFile = fopen(spill.fnmFile.str_String, "wb");
+  if (pFile == NULL) return;
+
+  const BOOL bWritten = (fwrite(spill.pubData, spill.slSize, 1, pFile) == 1);
+  fclose(pFile);
+
+  // Keep the data in memory if it couldn't be written
+  if (!bWritten) {
+    remove(spill.fnmFile.str_String);
+    return;
+  }
+
+  IStreamStats::BufferFreed(spill.pubData);
+  free(spill.pubData);
+  spill.pubData = NULL;
+};
+
+// Memory that's taken by session state
+SLONG CRemLevel::MemoryUsage(void) const {
+  // Still in memory until it's written on disk, which may also fail
+  if (rl_pSpill != NULL) {
+    return (rl_pSpill->pubData != NULL) ? rl_pSpill->slSize : 0;
+  }
+
+  if (rl_pubCompressed != NULL) return rl_slCompressed;
+
+  return strm_pubMaxPos - strm_pubBufferBegin;
+};
+
+// Move session state into a temporary file in the background
+void CRemLevel::Spill(void) {
+  // Already spilled
+  if (rl_pSpill != NULL) return;
+
+  static INDEX _iSpillFile = 0;
+
+  const CTFileName fnmDir = _fnmApplicationPath + CTString("Temp\\");
+  CreateDirectoryA(fnmDir.str_String, NULL);
+
+  rl_pSpill = new RemLevelSpill;
+  rl_pSpill->fnmFile.PrintF("%sRemLevel%d_%d.tmp", fnmDir.str_String, GetCurrentProcessId(), _iSpillFile++);
+
+  if (rl_pubCompressed != NULL) {
+    // Hand compressed data over
+    rl_pSpill->pubData = rl_pubCompressed;
+    rl_pSpill->slSize = rl_slCompressed;
+    rl_pSpill->bCompressed = TRUE;
+
+    IStreamStats::BufferFreed(rl_pubCompressed);
+    rl_pubCompressed = NULL;
+    rl_slCompressed = 0;
+
+  } else {
+    // Copy written stream contents and get rid of the write buffer
+    rl_slSize = strm_pubMaxPos - strm_pubBufferBegin;
+
+    rl_pSpill->pubData = (UBYTE *)malloc(rl_slSize);
+    rl_pSpill->slSize = rl_slSize;
+    rl_pSpill->bCompressed = FALSE;
+
+    memcpy(rl_pSpill->pubData, strm_pubBufferBegin, rl_slSize);
+    P_FreeBuffer();
+  }
+
+  IStreamStats::BufferAllocated(rl_pSpill->pubData, rl_pSpill->slSize, IStreamStats::EBO_SPILL, rl_strFileName);
+
+  if (!_wpSpill.IsStarted()) {
+    _wpSpill.Start(1, THREAD_PRIORITY_BELOW_NORMAL);
+  }
+
+  _wpSpill.AddJob(&WriteSpill, rl_pSpill);
+};
+
+// Load session state back from the temporary file
+void CRemLevel::Reload(void) {
+  // Not spilled
+  if (rl_pSpill == NULL) return;
+
+  // Finish pending writes
+  _wpSpill.Wait();
+
+  RemLevelSpill *pSpill = rl_pSpill;
+  rl_pSpill = NULL;
+
+  UBYTE *pubData = pSpill->pubData;
+  IStreamStats::BufferFreed(pubData);
+
+  // Read from the file if it has been written
+  if (pubData == NULL) {
+    pubData = (UBYTE *)malloc(pSpill->slSize);
+
+    FILE *pFile = fopen(pSpill->fnmFile.str_String, "rb");
+    const BOOL bRead = (pFile != NULL && fread(pubData, pSpill->slSize, 1, pFile) == 1);
+
+    if (pFile != NULL) fclose(pFile);
+
+    if (!bRead) {
+      free(pubData);
+      remove(pSpill->fnmFile.str_String);
+      delete pSpill;
+
+      ThrowF_t(LOCALIZE("Cannot read remembered level '%s' from the disk"), rl_strFileName.str_String);
+    }
+
+    remove(pSpill->fnmFile.str_String);
+  }
+
+  if (pSpill->bCompressed) {
+    rl_pubCompressed = pubData;
+    rl_slCompressed = pSpill->slSize;
+
+    IStreamStats::BufferAllocated(rl_pubCompressed, rl_slCompressed, IStreamStats::EBO_REMLEVEL, rl_strFileName);
+
+  } else {
+    AllocBuffer(pSpill->slSize);
+    memcpy(strm_pubBufferBegin, pubData, pSpill->slSize);
+    strm_pubMaxPos = strm_pubBufferBegin + pSpill->slSize;
+
+    free(pubData);
+  }
+
+  delete pSpill;
+};
+
+// Wait until all remembered levels are written on disk and stop the thread
+void CRemLevel::StopSpilling(void) {
+  _wpSpill.Wait();
+  _wpSpill.Stop();
+};
+
+// Move the least recently remembered levels on disk until the rest fits into the budget
+static void SpillRememberedLevels(CListHead &lhLevels) {
+  // No limit
+  if (_EnginePatches._iRemLevelsMemory <= 0) return;
+
+  const SLONG slBudget = _EnginePatches._iRemLevelsMemory * 1024;
+  SLONG slTotal = 0;
+
+  FOREACHINLIST(CRemLevel, rl_lnInSessionState, lhLevels, itrlCount) {
+    slTotal += itrlCount->MemoryUsage();
+  }
+
+  // Levels are added at the end, so the oldest ones are in the beginning
+  FOREACHINLIST(CRemLevel, rl_lnInSessionState, lhLevels, itrl) {
+    if (slTotal <= slBudget) break;
+
+    slTotal -= itrl->MemoryUsage();
+    itrl->Spill();
+  }
 };
 
 // Remember current level by its filename
 void CRemLevelPatch::P_RememberCurrentLevel(const CTString &strFileName)
 {
-  for (;;) {
-    CRemLevel *prlOld = P_FindRememberedLevel(strFileName);
-
-    if (prlOld == NULL) {
-      break;
-    }
+  // [Cecil] Levels are unique in the table, so there can be only one to replace
+  CRemLevel *prlOld = P_FindRememberedLevel(strFileName);
 
+  if (prlOld != NULL) {
     prlOld->rl_lnInSessionState.Remove();
     delete prlOld;
   }
@@ -243,21 +740,24 @@ void CRemLevelPatch::P_RememberCurrentLevel(const CTString &strFileName)
   ses_lhRememberedLevels.AddTail(prlNew->rl_lnInSessionState);
 
   prlNew->rl_strFileName = strFileName;
+  RemLevelTable().Add(prlNew);
+
   WriteWorldAndState_t(prlNew);
+
+  // [Cecil] Don't keep raw session state of every visited level around
+  if (_EnginePatches._bCompressRemLevels) {
+    prlNew->Compress();
+  }
+
+  // [Cecil] Keep memory taken by remembered levels under control
+  SpillRememberedLevels(ses_lhRememberedLevels);
 };
 
 // Fine remembered level by its filename
 CRemLevel *CRemLevelPatch::P_FindRememberedLevel(const CTString &strFileName)
 {
-  FOREACHINLIST(CRemLevel, rl_lnInSessionState, ses_lhRememberedLevels, itrl) {
-    CRemLevel &rl = *itrl;
-
-    if (rl.rl_strFileName == strFileName) {
-      return &rl;
-    }
-  }
-
-  return NULL;
+  // [Cecil] Look it up by its name instead of going through the list
+  return RemLevelTable().Find(strFileName);
 };
 
 // Restore old level by its filename
@@ -267,6 +767,10 @@ void CRemLevelPatch::P_RestoreOldLevel(const CTString &strFileName)
   ASSERT(prlOld != NULL);
 
   try {
+    // [Cecil] Load session state from the disk and unpack it, if needed
+    prlOld->Reload();
+    prlOld->Decompress();
+
     prlOld->SetPos_t(0);
     _pTimer->SetCurrentTick(0.0f);
 
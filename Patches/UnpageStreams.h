@@ -32,6 +32,15 @@ class CUnpageStreamPatch : public CTStream {
 
     // Free memory normally
     void P_FreeBuffer(void);
+
+    // Take over contents in a buffer from malloc() that's padded in the same way as in P_AllocVirtualMemory()
+    void AdoptBuffer(UBYTE *pubBuffer, ULONG ulBytes);
+
+    // Read contents in a buffer that's owned by the decompressed entry cache and padded in the same way
+    void ShareBuffer(UBYTE *pubBuffer, ULONG ulBytes);
+
+    // Take contents away from a stream, so they can be freed with free() later (NULL if they can't be)
+    UBYTE *DetachBuffer(void);
 };
 
 // CTFileStream patches
@@ -54,12 +63,223 @@ class CFileStreamPatch : public CUnpageStreamPatch {
     void P_Close(void);
 };
 
+// ZIP handle of a file stream that has been opened from memory (decompressed entry cache or a background read)
+#define ZIP_HANDLE_CACHED (-2)
+
+// Synchronize ZIP access between the main thread and background workers
+extern CTCriticalSection _csUnzip;
+
+// Stream buffers are allocated normally and hold entire contents
+extern BOOL _bUnpagedStreams;
+
+// Cache of decompressed ZIP entries that is shared between file streams
+namespace IZipCache {
+
+// Open stream from a cached entry, if there is one
+BOOL Open(CUnpageStreamPatch &strm, const CTFileName &fnmFile, INDEX iType);
+
+// Decompress an entry into the cache and open stream from it (FALSE if it shouldn't be cached)
+BOOL Add_t(CUnpageStreamPatch &strm, const CTFileName &fnmFile, INDEX iType, INDEX iHandle, SLONG slSize);
+
+// Stop reading contents of a cached entry (FALSE if the buffer isn't from the cache)
+BOOL Release(UBYTE *pubData);
+
+// Decompress an entry ahead of time
+void Prefetch(const CTFileName &fnmFile, INDEX iType);
+
+// Forget all cached entries (entries that are being read are freed once they're closed)
+void Clear(void);
+
+}; // namespace
+
+// Big ZIP entries that are decompressed gradually as they're being read
+namespace IZipWindow {
+
+// Start decompressing a ZIP entry into the stream as it's being read (FALSE if it should be decompressed at once)
+BOOL Start(CUnpageStreamPatch &strm, INDEX iHandle, SLONG slSize);
+
+// Free stream buffer if it's being decompressed in windows
+BOOL Free(UBYTE *pubBuffer);
+
+// Function that makes some part of a reserved buffer accessible (FALSE if it can't)
+typedef BOOL (*CAccessFunc)(void *pData, const UBYTE *pubAddress);
+
+// Let some function make parts of a reserved buffer accessible when they're accessed (FALSE if it's not possible)
+BOOL Watch(UBYTE *pubBuffer, SLONG slReserved, CAccessFunc pFunc, void *pData);
+
+// Stop handling access to a reserved buffer
+void Unwatch(UBYTE *pubBuffer);
+
+// Stop handling access to stream buffers
+void Stop(void);
+
+}; // namespace
+
+// Loose files that are being read in the background
+namespace IFileReads {
+
+// Start reading a batch of files
+void Submit(const CTFileName *afnmFiles, INDEX ct);
+
+// Open stream from a background read of a file, if there is one
+BOOL Open(CUnpageStreamPatch &strm, const CTFileName &fnmFile);
+
+// Forget background read of a file that's about to be overwritten
+void Drop(const CTFileName &fnmFile);
+
+// Drop all reads and stop the backend
+void Stop(void);
+
+}; // namespace
+
+// Demos that are written to disk while being recorded
+namespace IDemoBlocks {
+
+// Start writing a demo stream to disk in blocks as it's being recorded
+void Start(CTFileStream &strm);
+
+// Write full blocks of recorded data to disk (FALSE if the demo can't be written anymore)
+BOOL Update(void);
+
+// Get position in the plain demo that's being recorded
+SLONG Position(CTFileStream &strm);
+
+// Write the rest of the demo and the block index before closing the stream
+void Finish(CTFileStream &strm);
+
+// Start decompressing demo in blocks that has just been read into the stream as it's being played
+void Unpack(CFileStreamPatch &strm);
+
+// Free stream buffer if it's a demo that's being decompressed
+BOOL Free(UBYTE *pubBuffer);
+
+}; // namespace
+
+// Stream I/O counters and timings
+namespace IStreamStats {
+
+// Where streams are opened from
+enum EStreamLayer {
+  ESL_FILE = 0, // Loose file
+  ESL_MODZIP,   // Mod archive entry
+  ESL_BASEZIP,  // Game archive entry
+  ESL_CACHE,    // Decompressed entry cache
+  ESL_UPDATE,   // Existing file opened for writing
+  ESL_CREATE,   // New file
+
+  ESL_MAX,
+};
+
+// What stream buffers are used for
+enum EBufferOwner {
+  EBO_MEMORY = 0, // Generic memory stream
+  EBO_FILE,       // Loose file
+  EBO_ZIP,        // ZIP entry
+  EBO_REMLEVEL,   // Remembered level
+  EBO_DEMO,       // Demo playback or recording
+  EBO_ZIPCACHE,   // Decompressed entry cache
+  EBO_FILEREAD,   // Background read of a loose file
+  EBO_SPILL,      // Remembered level that's waiting to be written on disk
+
+  EBO_MAX,
+};
+
+// Collected statistics
+struct Stats {
+  INDEX actOpened[ESL_MAX]; // Opened streams per layer
+  DOUBLE adOpenTime[ESL_MAX]; // Time spent opening streams per layer
+  INDEX ctClosed;
+  DOUBLE dCloseTime;
+  INDEX ctAllocations;
+  INDEX ctFrees;
+  DOUBLE dAllocTime;
+
+  __int64 llBytesRead; // Read from disk or archives
+  __int64 llBytesDecompressed; // Decompressed from archives
+  __int64 llBytesWritten; // Flushed into files
+
+  __int64 llLiveMemory; // Currently allocated stream buffers
+  __int64 llPeakMemory; // Highest amount of allocated stream buffers
+
+  INDEX ctLargePages; // Buffers that have been allocated with large pages
+  INDEX ctLargePageFallbacks; // Buffers that couldn't get large pages
+};
+
+// Current time for measuring phases
+inline DOUBLE Now(void) {
+  // Streams may be used before the timer is created
+  if (_pTimer == NULL) return 0.0;
+
+  return _pTimer->GetHighPrecisionTimer().GetSeconds();
+};
+
+// Stream has been opened or created
+void Opened(CTStream *pstrm, EStreamLayer eLayer, SLONG slRead, SLONG slDecompressed, DOUBLE dStartTime);
+
+// More of a stream has been decompressed after opening it
+void Decompressed(SLONG slDecompressed);
+
+// Stream has been closed
+void Closed(SLONG slWritten, DOUBLE dStartTime);
+
+// Stream buffer has been allocated
+void Allocated(CTStream *pstrm, SLONG slBytes, BOOL bLargePages, DOUBLE dStartTime);
+
+// Stream buffer has been freed
+void Freed(CTStream *pstrm);
+
+// Specify what a stream buffer is used for
+void SetOwner(CTStream *pstrm, EBufferOwner eOwner);
+
+// Some other long-lived buffer has been allocated
+void BufferAllocated(const void *pBuffer, SLONG slBytes, EBufferOwner eOwner, const CTString &strDescription);
+
+// Some other long-lived buffer has been freed or handed over to a stream
+void BufferFreed(const void *pBuffer);
+
+// Large pages have been requested for a stream buffer
+void LargePages(BOOL bObtained);
+
+// Retrieve a copy of current statistics
+void Get(Stats &ss);
+
+// Print statistics into the console
+void Print(void);
+
+// Print currently allocated stream buffers into the console
+void PrintBuffers(void);
+
+// Dump statistics into a JSON file
+void Dump(void *pArgs);
+
+// Reset all counters except for currently allocated memory
+void Reset(void);
+
+// Measure throughput of patched streams with synthetic data
+void Benchmark(void *pArgs);
+
+}; // namespace
+
+// Session state of a remembered level that's been moved on disk
+struct RemLevelSpill {
+  CTFileName fnmFile; // Full path to the temporary file
+  UBYTE *pubData; // Data that's waiting to be written (NULL once it's on disk)
+  SLONG slSize; // Size of the data
+  BOOL bCompressed; // Whether it's compressed session state or raw stream contents
+};
+
 // CRememberedLevel clone that saves session state into itself
 class CRemLevel : public CUnpageStreamPatch {
   public:
     CListNode rl_lnInSessionState; // Node in the remembered levels list
     CTString rl_strFileName; // World filename
 
+    UBYTE *rl_pubCompressed; // Compressed session state (NULL if it's in the stream buffer)
+    SLONG rl_slCompressed; // Compressed size
+    SLONG rl_slSize; // Uncompressed size
+
+    RemLevelSpill *rl_pSpill; // Session state on disk (NULL if it's in memory)
+
   // CTMemoryStream method replacements
   public:
     // Constructor
@@ -68,6 +288,27 @@ class CRemLevel : public CUnpageStreamPatch {
     // Destructor
     ~CRemLevel(void);
 
+    // Compress written session state and free the stream buffer
+    void Compress(void);
+
+    // Allocate stream buffer for session state
+    void AllocBuffer(ULONG ulSize);
+
+    // Restore the stream buffer from compressed session state
+    void Decompress(void);
+
+    // Memory that's taken by session state
+    SLONG MemoryUsage(void) const;
+
+    // Move session state into a temporary file in the background
+    void Spill(void);
+
+    // Load session state back from the temporary file
+    void Reload(void);
+
+    // Wait until all remembered levels are written on disk and stop the thread
+    static void StopSpilling(void);
+
     // Always interactable
     BOOL IsReadable(void)  { return TRUE; };
     BOOL IsWriteable(void) { return TRUE; };
@@ -75,6 +316,11 @@ class CRemLevel : public CUnpageStreamPatch {
 
     // Dummy
     void HandleAccess(INDEX, BOOL) {};
+
+    // Name for the lookup table
+    inline const CTString &GetName(void) {
+      return rl_strFileName;
+    };
 };
 
 // Remembered levels without CTMemoryStream
@@ -95,4 +341,113 @@ class CRemLevelPatch : public CSessionState {
 
 #endif // _PATCHCONFIG_FIX_STREAMPAGING
 
+// Bounds-checked reader that works directly with the unpaged buffer of a stream
+// (falls back to reading through the stream if its buffer may be paged)
+class CStreamCursor {
+  public:
+    CTStream &sc_strm; // Stream that's being read
+    const UBYTE *sc_pubPos; // Current position in the buffer
+    const UBYTE *sc_pubEOF; // End of the stream
+    BOOL sc_bDirect; // Reading from the buffer
+
+  public:
+    // Start reading from the current stream position
+    CStreamCursor(CTStream &strm) : sc_strm(strm)
+    {
+    #if _PATCHCONFIG_ENGINEPATCHES && _PATCHCONFIG_FIX_STREAMPAGING
+      sc_bDirect = _bUnpagedStreams;
+    #else
+      sc_bDirect = FALSE;
+    #endif
+
+      Sync();
+    };
+
+    // Continue from the stream position after reading through the stream itself
+    inline void Sync(void) {
+      sc_pubPos = sc_strm.strm_pubCurrentPos;
+      sc_pubEOF = sc_strm.strm_pubEOF;
+    };
+
+    // Move stream position to where the cursor is
+    inline void Commit(void) {
+      if (sc_bDirect) sc_strm.strm_pubCurrentPos = (UBYTE *)sc_pubPos;
+    };
+
+    // Make sure that some amount of bytes can be read
+    inline void Require_t(SLONG slSize) {
+      if (slSize < 0 || slSize > sc_pubEOF - sc_pubPos) {
+        ThrowF_t(LOCALIZE("Reading past end of stream"));
+      }
+    };
+
+    // Read raw bytes
+    inline void Read_t(void *pvBuffer, SLONG slSize) {
+      if (!sc_bDirect) {
+        sc_strm.Read_t(pvBuffer, slSize);
+        return;
+      }
+
+      Require_t(slSize);
+      memcpy(pvBuffer, sc_pubPos, slSize);
+      sc_pubPos += slSize;
+    };
+
+    // Read any plain value
+    template<class Type> inline void Read_t(Type &val) {
+      if (!sc_bDirect) {
+        sc_strm.Read_t(&val, sizeof(Type));
+        return;
+      }
+
+      Require_t(sizeof(Type));
+      val = *(const Type *)sc_pubPos;
+      sc_pubPos += sizeof(Type);
+    };
+
+    // Read a string in the same format as the stream does
+    inline void ReadString_t(CTString &str) {
+      if (!sc_bDirect) {
+        sc_strm >> str;
+        return;
+      }
+
+      INDEX iLength;
+      Read_t(iLength);
+      Require_t(iLength);
+
+      // Strings cannot be constructed from a span, so copy and terminate it
+      char *strCopy = (char *)AllocMemory(iLength + 1);
+      memcpy(strCopy, sc_pubPos, iLength);
+      strCopy[iLength] = '\0';
+      sc_pubPos += iLength;
+
+      str = strCopy;
+      FreeMemory(strCopy);
+    };
+
+    // Check the next chunk ID without reading it
+    inline BOOL PeekID_t(const char *strID) {
+      if (!sc_bDirect) return sc_strm.PeekID_t() == CChunkID(strID);
+
+      Require_t(CID_LENGTH);
+      return memcmp(sc_pubPos, strID, CID_LENGTH) == 0;
+    };
+
+    // Read chunk ID and make sure that it's the expected one
+    inline void ExpectID_t(const char *strID) {
+      if (!sc_bDirect) {
+        sc_strm.ExpectID_t(strID);
+        return;
+      }
+
+      CChunkID cid;
+      Read_t(cid.cid_ID, CID_LENGTH);
+
+      if (memcmp(cid.cid_ID, strID, CID_LENGTH) != 0) {
+        ThrowF_t(LOCALIZE("Chunk ID validation failed.\nExpected ID \"%s\" but found \"%s\"\n"), strID, cid.cid_ID);
+      }
+    };
+};
+
 #endif
@@ -18,6 +18,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #if _PATCHCONFIG_ENGINEPATCHES
 
 #include "Worlds.h"
+#include "UnpageStreams.h"
 #include "../MapConversion.h"
 
 #include <Engine/Templates/Stock_CEntityClass.h>
@@ -165,15 +166,18 @@ void CWorldPatch::P_LoadBrushes(const CTFileName &fnmWorld) {
 
 // Read world information
 void CWorldPatch::P_ReadInfo(CTStream *strm, BOOL bMaybeDescription) {
+  // [Cecil] Read everything directly from the buffer
+  CStreamCursor sc(*strm);
+
   // Read entire world info
-  if (strm->PeekID_t() == CChunkID("WLIF")) {
-    strm->ExpectID_t(CChunkID("WLIF"));
+  if (sc.PeekID_t("WLIF")) {
+    sc.ExpectID_t("WLIF");
 
     // [Cecil] "DTRS" in the EXE as is gets picked up by the Depend utility
-    static const CChunkID chnkDTRS(CTString("DT") + "RS");
+    static const CTString strDTRS = CTString("DT") + "RS";
 
-    if (strm->PeekID_t() == chnkDTRS) {
-      strm->ExpectID_t(chnkDTRS);
+    if (sc.PeekID_t(strDTRS.str_String)) {
+      sc.ExpectID_t(strDTRS.str_String);
     }
 
     // [Cecil] Rev: Read new world info
@@ -182,19 +186,19 @@ void CWorldPatch::P_ReadInfo(CTStream *strm, BOOL bMaybeDescription) {
       ULONG aulExtra[3] = { 0, 0, 0 };
 
       // Read leaderboard
-      if (strm->PeekID_t() == CChunkID("LDRB")) {
-        strm->ExpectID_t("LDRB");
-        *strm >> strLeaderboard;
+      if (sc.PeekID_t("LDRB")) {
+        sc.ExpectID_t("LDRB");
+        sc.ReadString_t(strLeaderboard);
 
         _EnginePatches._eWorldFormat = E_LF_SSR;
       }
 
       // Read unknown values
-      if (strm->PeekID_t() == CChunkID("Plv0")) {
-        strm->ExpectID_t("Plv0");
-        *strm >> aulExtra[0];
-        *strm >> aulExtra[1];
-        *strm >> aulExtra[2];
+      if (sc.PeekID_t("Plv0")) {
+        sc.ExpectID_t("Plv0");
+        sc.Read_t(aulExtra[0]);
+        sc.Read_t(aulExtra[1]);
+        sc.Read_t(aulExtra[2]);
 
         _EnginePatches._eWorldFormat = E_LF_SSR;
       }
@@ -209,14 +213,14 @@ void CWorldPatch::P_ReadInfo(CTStream *strm, BOOL bMaybeDescription) {
     }
 
     // Read display name
-    *strm >> wo_strName;
+    sc.ReadString_t(wo_strName);
 
     // Read flags
-    *strm >> wo_ulSpawnFlags;
+    sc.Read_t(wo_ulSpawnFlags);
 
     // [Cecil] Rev: Read special gamemode chunk
-    if (strm->PeekID_t() == CChunkID("SpGM")) {
-      strm->ExpectID_t("SpGM");
+    if (sc.PeekID_t("SpGM")) {
+      sc.ExpectID_t("SpGM");
       _EnginePatches._eWorldFormat = E_LF_SSR;
 
     } else {
@@ -227,12 +231,14 @@ void CWorldPatch::P_ReadInfo(CTStream *strm, BOOL bMaybeDescription) {
     }
 
     // Read world description
-    *strm >> wo_strDescription;
+    sc.ReadString_t(wo_strDescription);
 
   // Only read description
   } else if (bMaybeDescription) {
-    *strm >> wo_strDescription;
+    sc.ReadString_t(wo_strDescription);
   }
+
+  sc.Commit();
 };
 
 // Create a new entity of a given class
@@ -0,0 +1,189 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#include "StdH.h"
+
+#include "WorkerPool.h"
+
+// Execute queued jobs until the pool is stopped
+static DWORD WINAPI WorkerThread(LPVOID pParam) {
+  CWorkerPool &wp = *(CWorkerPool *)pParam;
+  CWorkerPool::Job job;
+
+  FOREVER {
+    // Wait for new jobs
+    WaitForSingleObject(wp.wp_hJobsAdded, INFINITE);
+
+    if (wp.wp_bQuit) break;
+
+    // Another thread has already taken it
+    if (!wp.NextJob(job)) continue;
+
+    // Skip cancelled jobs
+    if (job.pFunc != NULL) {
+      // Jobs should handle their own errors but don't let them kill the thread
+      try {
+        job.pFunc(job.pData);
+
+      } catch (char *strError) {
+        (void)strError;
+      }
+    }
+
+    wp.FinishJob();
+  }
+
+  return 0;
+};
+
+// Constructor
+CWorkerPool::CWorkerPool(void) : wp_iNextJob(0), wp_ctBusy(0), wp_bQuit(FALSE)
+{
+  wp_hJobsAdded = CreateSemaphoreA(NULL, 0, 0x7FFFFFFF, NULL);
+  wp_hIdle = CreateEventA(NULL, TRUE, TRUE, NULL);
+};
+
+// Destructor
+CWorkerPool::~CWorkerPool(void)
+{
+  // [Cecil] NOTE: Threads aren't stopped here because waiting for them during library unloading
+  // can deadlock; they are terminated together with the process if Stop() hasn't been called
+  if (IsStarted()) return;
+
+  CloseHandle(wp_hJobsAdded);
+  CloseHandle(wp_hIdle);
+};
+
+// Start a specific amount of threads with some priority
+void CWorkerPool::Start(INDEX ctThreads, int iPriority) {
+  ASSERT(!IsStarted());
+  wp_bQuit = FALSE;
+
+  for (INDEX iThread = 0; iThread < ctThreads; iThread++) {
+    DWORD dwThreadID;
+    HANDLE hThread = CreateThread(NULL, 0, &WorkerThread, this, 0, &dwThreadID);
+
+    if (hThread == NULL) continue;
+
+    SetThreadPriority(hThread, iPriority);
+    wp_ahThreads.Push() = hThread;
+  }
+};
+
+// Wait for running jobs, drop queued ones and stop all threads
+void CWorkerPool::Stop(void) {
+  if (!IsStarted()) return;
+
+  // Drop everything that hasn't started yet
+  CancelJobs(NULL);
+
+  // Wake up every thread to let them exit
+  wp_bQuit = TRUE;
+
+  const INDEX ctThreads = wp_ahThreads.Count();
+  ReleaseSemaphore(wp_hJobsAdded, ctThreads, NULL);
+
+  WaitForMultipleObjects(ctThreads, &wp_ahThreads[0], TRUE, INFINITE);
+
+  for (INDEX iThread = 0; iThread < ctThreads; iThread++) {
+    CloseHandle(wp_ahThreads[iThread]);
+  }
+
+  wp_ahThreads.PopAll();
+
+  // Reset the queue
+  CTSingleLock slJobs(&wp_csJobs, TRUE);
+
+  wp_aJobs.PopAll();
+  wp_iNextJob = 0;
+  wp_ctBusy = 0;
+  SetEvent(wp_hIdle);
+};
+
+// Queue a new job
+void CWorkerPool::AddJob(CWorkerJobFunc pFunc, void *pData, CWorkerJobFunc pDiscard) {
+  // Execute right away if there are no threads
+  if (!IsStarted()) {
+    pFunc(pData);
+    return;
+  }
+
+  CTSingleLock slJobs(&wp_csJobs, TRUE);
+
+  Job &job = wp_aJobs.Push();
+  job.pFunc = pFunc;
+  job.pDiscard = pDiscard;
+  job.pData = pData;
+
+  ResetEvent(wp_hIdle);
+  ReleaseSemaphore(wp_hJobsAdded, 1, NULL);
+};
+
+// Drop jobs of some type that haven't started yet and return how many have been dropped
+INDEX CWorkerPool::CancelJobs(CWorkerJobFunc pFunc) {
+  CTSingleLock slJobs(&wp_csJobs, TRUE);
+  INDEX ctCancelled = 0;
+
+  for (INDEX iJob = wp_iNextJob; iJob < wp_aJobs.Count(); iJob++) {
+    Job &job = wp_aJobs[iJob];
+
+    // Already cancelled or a different job
+    if (job.pFunc == NULL) continue;
+    if (pFunc != NULL && job.pFunc != pFunc) continue;
+
+    if (job.pDiscard != NULL) {
+      job.pDiscard(job.pData);
+    }
+
+    // Threads will skip it
+    job.pFunc = NULL;
+    ctCancelled++;
+  }
+
+  return ctCancelled;
+};
+
+// Wait until all queued and running jobs are finished
+void CWorkerPool::Wait(void) {
+  if (!IsStarted()) return;
+
+  WaitForSingleObject(wp_hIdle, INFINITE);
+};
+
+// Retrieve the next job to execute (returns FALSE if there are none)
+BOOL CWorkerPool::NextJob(Job &job) {
+  CTSingleLock slJobs(&wp_csJobs, TRUE);
+
+  if (wp_iNextJob >= wp_aJobs.Count()) return FALSE;
+
+  job = wp_aJobs[wp_iNextJob++];
+  wp_ctBusy++;
+
+  return TRUE;
+};
+
+// Mark one of the running jobs as finished
+void CWorkerPool::FinishJob(void) {
+  CTSingleLock slJobs(&wp_csJobs, TRUE);
+  wp_ctBusy--;
+
+  // Reset the queue once everything is done
+  if (wp_ctBusy == 0 && wp_iNextJob >= wp_aJobs.Count()) {
+    wp_aJobs.PopAll();
+    wp_iNextJob = 0;
+
+    SetEvent(wp_hIdle);
+  }
+};
@@ -0,0 +1,82 @@
+/* Copyright (c) 2024 Dreamy Cecil
+This program is free software; you can redistribute it and/or modify
+it under the terms of version 2 of the GNU General Public License as published by
+the Free Software Foundation
+
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA. */
+
+#ifndef CECIL_INCL_WORKERPOOL_H
+#define CECIL_INCL_WORKERPOOL_H
+
+#ifdef PRAGMA_ONCE
+  #pragma once
+#endif
+
+// Function that executes a job on a worker thread
+typedef void (*CWorkerJobFunc)(void *pData);
+
+// Pool of background threads that execute queued jobs in order
+class CWorkerPool {
+  public:
+    // Queued job
+    struct Job {
+      CWorkerJobFunc pFunc; // Job execution
+      CWorkerJobFunc pDiscard; // Data cleanup if the job gets dropped before execution
+      void *pData;
+    };
+
+  public:
+    CStaticStackArray<HANDLE> wp_ahThreads; // Running threads
+    CStaticStackArray<Job> wp_aJobs; // Queued jobs
+    INDEX wp_iNextJob; // Next job in the queue to execute
+    INDEX wp_ctBusy; // Jobs that are currently being executed
+
+    CTCriticalSection wp_csJobs; // Access to the job queue
+    HANDLE wp_hJobsAdded; // Semaphore for waking up threads
+    HANDLE wp_hIdle; // Set when there are no queued or running jobs
+    BOOL wp_bQuit; // Threads should exit
+
+  public:
+    // Constructor
+    CWorkerPool(void);
+
+    // Destructor
+    ~CWorkerPool(void);
+
+    // Check if any threads are running
+    inline BOOL IsStarted(void) const {
+      return wp_ahThreads.Count() != 0;
+    };
+
+    // Start a specific amount of threads with some priority
+    void Start(INDEX ctThreads, int iPriority = THREAD_PRIORITY_NORMAL);
+
+    // Wait for running jobs, drop queued ones and stop all threads
+    void Stop(void);
+
+    // Queue a new job
+    void AddJob(CWorkerJobFunc pFunc, void *pData, CWorkerJobFunc pDiscard = NULL);
+
+    // Drop jobs of some type that haven't started yet and return how many have been dropped
+    INDEX CancelJobs(CWorkerJobFunc pFunc);
+
+    // Wait until all queued and running jobs are finished
+    void Wait(void);
+
+  public:
+    // Retrieve the next job to execute (returns FALSE if there are none)
+    BOOL NextJob(Job &job);
+
+    // Mark one of the running jobs as finished
+    void FinishJob(void);
+};
+
+#endif